@@ -40,6 +40,7 @@ or implied, of CowboyCoders.
 #include "cow/piece_data.hpp"
 #include "cow/piece_request.hpp"
 #include "cow/download_control.hpp"
+#include "cow/http_stream_server.hpp"
 #include "cow/progress_info.hpp"
 #include "cow/on_demand_server_connection_factory.hpp"
 #include "cow/multicast_server_connection_factory.hpp"
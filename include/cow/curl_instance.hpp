@@ -33,6 +33,7 @@ or implied, of CowboyCoders.
 
 #include <boost/log/trivial.hpp>
 #include <boost/bind.hpp>
+#include <boost/function.hpp>
 
 #include <curl/curl.h>
 #include <curl/types.h>
@@ -55,11 +56,32 @@ namespace libcow
 
         ~curl_instance();
 
+       /**
+        * Sets a function that is polled while a request is in progress.
+        * The request is aborted, and throws, when the function returns true.
+        * @param abort_function The function to poll.
+        */
+        void set_abort_function(const boost::function<bool()>& abort_function)
+        {
+            abort_function_ = abort_function;
+        }
+
         std::stringstream& perform_unbounded_request(size_t timeout, 
                                                    const std::vector<std::string>& headers);
         utils::buffer perform_bounded_request(size_t timeout, 
                                               const std::vector<std::string>& headers,
                                               size_t buffer_size);
+
+       /**
+        * Requests a range of bytes of the file with an HTTP Range header. The 
+        * server must answer with 206 Partial Content. At the end of the file,
+        * fewer than length bytes may be written to the buffer.
+        * @param timeout The timeout in seconds.
+        * @param offset The offset of the first byte to request.
+        * @param length The number of bytes to request.
+        * @return A buffer of length bytes.
+        */
+        utils::buffer perform_range_request(size_t timeout, size_t offset, size_t length);
                            
     private:
         size_t write_allocated_data(void *downloaded_data,
@@ -86,7 +108,7 @@ namespace libcow
         void check_curl_code(CURLcode code);
         void set_timeout(size_t timeout);
         void set_headers(const std::vector<std::string>& headers);
-        void execute_curl_request();
+        void execute_curl_request(long expected_http_code = 200);
         
         long get_http_code() 
         {
@@ -100,6 +122,7 @@ namespace libcow
         size_t allocated_buffer_size_;
         size_t bytes_written_;
         std::stringstream dynamic_buffer_;
+        boost::function<bool()> abort_function_;
         CURL *curl;
     };
 }
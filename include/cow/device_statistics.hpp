@@ -0,0 +1,134 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL COWBOYCODERS OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of CowboyCoders.
+*/
+
+#ifndef ___libcow_device_statistics___
+#define ___libcow_device_statistics___
+
+#include <cstddef>
+
+namespace libcow 
+{
+   /**
+    * Keeps track of how well a random access download_device performs: the
+    * latency until the first piece of a request arrives, the throughput
+    * once the data is flowing, and how often requests fail. All three are
+    * exponentially weighted moving averages. Devices without samples are
+    * assumed to be fast, so that new devices get tried.
+    * This class is not thread safe.
+    */
+    class device_statistics
+    {
+    public:
+        device_statistics();
+
+       /**
+        * Records that a request has been sent to the device.
+        * @param bytes The number of bytes that were requested.
+        */
+        void request_sent(size_t bytes);
+
+       /**
+        * Records that requested data has been delivered by the device.
+        * @param bytes The number of bytes that were delivered.
+        */
+        void bytes_delivered(size_t bytes);
+
+       /**
+        * Records the time until the first piece of a request arrived.
+        * @param seconds The latency in seconds.
+        */
+        void add_latency(double seconds);
+
+       /**
+        * Records the rate at which the data of a request arrived.
+        * @param bytes_per_second The throughput in bytes per second.
+        */
+        void add_throughput(double bytes_per_second);
+
+       /**
+        * Records that a request was completed.
+        */
+        void request_succeeded();
+
+       /**
+        * Records that a request failed or timed out.
+        * @param bytes The number of requested bytes that will never arrive.
+        */
+        void request_failed(size_t bytes);
+
+       /**
+        * Estimates when a new request would be completed, taking the data
+        * that is still queued at the device and the error rate into account.
+        * @param bytes The number of bytes to request.
+        * @return The expected time until completion in seconds.
+        */
+        double expected_completion(size_t bytes) const;
+
+       /**
+        * @return The estimated latency in seconds.
+        */
+        double latency() const
+        {
+            return latency_;
+        }
+
+       /**
+        * @return The estimated throughput in bytes per second.
+        */
+        double throughput() const
+        {
+            return throughput_;
+        }
+
+       /**
+        * @return The fraction of requests that fail, between 0 and 1.
+        */
+        double error_rate() const
+        {
+            return error_rate_;
+        }
+
+       /**
+        * @return The number of requested bytes that haven't arrived yet.
+        */
+        size_t queued_bytes() const
+        {
+            return queued_bytes_;
+        }
+
+    private:
+        double latency_;
+        double throughput_;
+        double error_rate_;
+        size_t queued_bytes_;
+        bool has_latency_;
+        bool has_throughput_;
+    };
+}
+
+#endif // ___libcow_device_statistics___
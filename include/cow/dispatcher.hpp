@@ -32,8 +32,13 @@ or implied, of CowboyCoders.
 #include <boost/thread.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
+#include <boost/function.hpp>
+#include <boost/cstdint.hpp>
 #include <boost/utility.hpp>
 
+#include <map>
+#include <vector>
+
 namespace libcow {
 
    /**
@@ -43,15 +48,31 @@ namespace libcow {
     * Since the jobs are not run in parallell, it's safe to share resources
     * between them.
     * This class is a wrapper around the boost::asio::io_service class.
+    *
+    * Delayed and periodic jobs are kept in a hashed timer wheel that is
+    * advanced by a single asio timer, so any number of them can be pending
+    * without each one needing a timer of its own. They are run in the worker
+    * thread like any other job, with a resolution of timer_resolution ms.
     */
     class LIBCOW_EXPORT dispatcher : public boost::noncopyable
     {
     public:
+       /**
+        * Identifies a delayed or periodic job, for cancelling it.
+        */
+        typedef boost::uint64_t timer_id;
+
+       /**
+        * The granularity in milliseconds of delayed and periodic jobs.
+        */
+        static const int timer_resolution = 10;
+
        /**
         * Creates a new dispatcher and spawns an internal worker thread. When
         * created, the dispatcher immediately starts processing any incoming
         * jobs (use the dispatcher::post method to put a job on the queue).
-        * @param timer_delay The delay in milliseconds to use for the deadline timer.
+        * @param timer_delay The delay in milliseconds to use for post_delayed
+        * when no delay is specified.
         */
         dispatcher(int timer_delay);
 
@@ -74,18 +95,47 @@ namespace libcow {
             io_service.post(handler);
         }
 
+       /**
+        * Adds an argument-less function object to the job queue.
+        * It's safe to call this function from multiple threads.
+        * The (asynchronous) invocation of the function object will be 
+        * delayed by the timer_delay that the dispatcher was created with.
+        * @param handler A function object, perhaps created using boost::bind.
+        * @return The id of the job, for cancel.
+        */
+        timer_id post_delayed(const boost::function<void()>& handler);
+
        /**
         * Adds an argument-less function object to the job queue.
         * It's safe to call this function from multiple threads.
         * The (asynchronous) invocation of the function object will be 
         * delayed by the specified number of milliseconds.
         * @param handler A function object, perhaps created using boost::bind.
+        * @param delay The delay in milliseconds.
+        * @return The id of the job, for cancel.
         */
-        template<typename CompletionHandler>
-        void post_delayed(const CompletionHandler& handler)
-        {
-            deadline_timer.async_wait(handler);
-        }
+        timer_id post_delayed(const boost::function<void()>& handler, int delay);
+
+       /**
+        * Runs an argument-less function object every interval milliseconds,
+        * starting interval milliseconds from now, until it is cancelled.
+        * It's safe to call this function from multiple threads.
+        * @param handler A function object, perhaps created using boost::bind.
+        * @param interval The interval in milliseconds.
+        * @return The id of the job, for cancel.
+        */
+        timer_id post_periodic(const boost::function<void()>& handler, int interval);
+
+       /**
+        * Cancels a delayed or periodic job. A job that is cancelled from
+        * the worker thread is guaranteed not to run again, while a job that
+        * is cancelled from another thread may already be running.
+        * It's safe to call this function from multiple threads.
+        * @param id The id returned by post_delayed or post_periodic.
+        * @return True if the job was pending, false if it had already run
+        * or been cancelled.
+        */
+        bool cancel(timer_id id);
 
         void stop()
         {
@@ -93,6 +143,39 @@ namespace libcow {
         }
 
      private:
+        struct timer
+        {
+            boost::function<void()> handler;
+            // the tick to run the job at
+            boost::uint64_t expiry;
+            // in ticks, 0 for jobs that only run once
+            boost::uint64_t interval;
+        };
+
+        timer_id add_timer(const boost::function<void()>& handler, int delay, int interval);
+        boost::uint64_t current_tick() const;
+        void schedule_tick();
+        boost::uint64_t next_expiry();
+        void handle_tick(const boost::system::error_code& error);
+        void collect_expired(size_t slot, boost::uint64_t tick, std::vector<timer_id>& expired);
+        void run_timer(timer_id id, boost::uint64_t tick);
+
+        int timer_delay_;
+
+        // protects everything below, which is shared with the posting threads
+        boost::mutex timer_mutex_;
+        std::map<timer_id, timer> timers_;
+        // the wheel, where slot n holds the timers that expire at ticks
+        // equal to n modulo its size. Cancelled timers are removed lazily.
+        std::vector<std::vector<timer_id> > wheel_;
+        timer_id next_timer_id_;
+        // the last tick whose slot has been processed
+        boost::uint64_t last_tick_;
+        bool ticking_;
+        // the tick that the deadline_timer has been set to wake up at
+        boost::uint64_t armed_tick_;
+
+        boost::posix_time::ptime start_time_;
 
         // don't reorder these!
         boost::asio::io_service io_service;
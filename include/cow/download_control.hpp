@@ -35,12 +35,22 @@ or implied, of CowboyCoders.
 #include <cow/download_control_event_handler.hpp>
 #include <cow/download_control_worker.hpp>
 #include <cow/exceptions.hpp>
+#include <cow/file_reader.hpp>
+#include <cow/mapped_view.hpp>
+#include <cow/piece_availability.hpp>
+#include <cow/piece_state_table.hpp>
+#include <cow/piece_cache.hpp>
 
 #include <boost/noncopyable.hpp>
 #include <boost/log/trivial.hpp>
 #include <libtorrent/torrent_handle.hpp>
 #include <libtorrent/alert.hpp>
+#include <boost/atomic.hpp>
 #include <boost/thread.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/scoped_ptr.hpp>
+
+namespace boost { namespace interprocess { class file_mapping; } }
 
 namespace libcow {
 
@@ -55,12 +65,25 @@ namespace libcow {
     class LIBCOW_EXPORT download_control : public boost::noncopyable
     {
     public:
+       /**
+        * The type of the completion handlers used by async_read. The
+        * argument is the number of bytes that were read.
+        */
+        typedef boost::function<void(size_t)> read_handler;
+
+       /**
+        * A range to read with the vectored read_data: the byte offset of
+        * the range and the buffer to read it to.
+        */
+        typedef std::pair<size_t, libcow::utils::buffer> read_range;
+
        /**
         * Creates a new download_control and initializes attributes.
         * @param handle The torrent_handle which controls the BitTorrent
         * part of the download.
         * @param critical_window_length HENRY, document this
-        * @param critical_window_timeout HENRY, document this
+        * @param critical_window_timeout The timeout in ms for the pieces in the
+        * critical window, see set_critical_window_timeout.
         * @param id a unique id for this download device
         * @param download_directory the directory for the file
         */
@@ -83,7 +106,9 @@ namespace libcow {
         /**
          * This sets the timeout for the pieces in the critical 
          * window. Note that this function is asynchronous, 
-         * the timeout will changes as soon as possible
+         * the timeout will changes as soon as possible.
+         * Pieces that have been requested from a random access device for
+         * longer than this are requested from another device as well.
          *
          * @param timeout the new timeout in ms
          */ 
@@ -133,6 +158,95 @@ namespace libcow {
         */
         size_t read_data(size_t offset, libcow::utils::buffer& buffer);
 
+       /**
+        * This function reads data from offset into the buffer, but gives up
+        * if the data hasn't been downloaded within the specified timeout.
+        * The number of bytes to read is determined by the size of the buffer.
+        * @param offset The byte offset to start reading from.
+        * @param buffer The buffer to read data to.
+        * @param timeout The maximum time to wait for the data in ms. A negative
+        * timeout waits until the data has been downloaded.
+        * @return The number of bytes actually read. This is less than the
+        * size of the buffer if the timeout expired.
+        */
+        size_t read_data(size_t offset, libcow::utils::buffer& buffer, int timeout);
+
+       /**
+        * This function reads several ranges of the file in one call. Each
+        * range is given by a byte offset and the buffer to read the data to,
+        * and the number of bytes to read is determined by the size of the
+        * buffer. Ranges that directly follow each other in the file are read
+        * from disk with a single vectored read. The function blocks until
+        * all the ranges have been downloaded.
+        * @param ranges The (offset, buffer) pairs to read.
+        * @return The total number of bytes actually read. The ranges are
+        * filled in order, and reading stops at the first range that can't be
+        * filled, e.g. at the end of the file.
+        */
+        size_t read_data(const std::vector<read_range>& ranges);
+
+       /**
+        * This function reads several ranges of the file in one call, but
+        * gives up if the ranges haven't been downloaded within the
+        * specified timeout.
+        * @param ranges The (offset, buffer) pairs to read.
+        * @param timeout The maximum time to wait for the data in ms. A negative
+        * timeout waits until the data has been downloaded.
+        * @return The total number of bytes actually read. The ranges are
+        * filled in order, and reading stops at the first range that can't be
+        * filled before the timeout expires.
+        */
+        size_t read_data(const std::vector<read_range>& ranges, int timeout);
+
+       /**
+        * This function reads data from offset into the buffer as soon as
+        * the data has been downloaded, without blocking the caller. The
+        * number of bytes to read is determined by the size of the buffer.
+        * The handler is called from an internal thread when the read has
+        * completed. The memory of the buffer must stay valid until then.
+        * Reads that are still pending when the download is removed are
+        * discarded.
+        * @param offset The byte offset to start reading from.
+        * @param buffer The buffer to read data to.
+        * @param handler The function to call with the number of bytes read.
+        */
+        void async_read(size_t offset, libcow::utils::buffer buffer, read_handler handler);
+
+       /**
+        * This function reads data from offset into the buffer as soon as
+        * the data has been downloaded, without blocking the caller.
+        * The memory of the buffer must stay valid until the read has completed.
+        * @param offset The byte offset to start reading from.
+        * @param buffer The buffer to read data to.
+        * @return A future that will hold the number of bytes read.
+        */
+        boost::unique_future<size_t> async_read(size_t offset, libcow::utils::buffer buffer);
+
+       /**
+        * This function maps the specified range of the downloaded file into
+        * memory and returns a read-only view of it, without copying any data.
+        * The function blocks until the range has been downloaded. The view
+        * keeps the mapping valid for as long as it is alive.
+        * @param offset The byte offset of the first byte to map.
+        * @param length The number of bytes to map. The view is truncated at
+        * the end of the file.
+        * @return A view of the range, or an empty view if the file couldn't
+        * be mapped.
+        */
+        mapped_view map_data(size_t offset, size_t length);
+
+       /**
+        * This function maps the specified range of the downloaded file into
+        * memory, but gives up if the range hasn't been downloaded within
+        * the specified timeout.
+        * @param offset The byte offset of the first byte to map.
+        * @param length The number of bytes to map.
+        * @param timeout The maximum time to wait for the data in ms.
+        * @return A view of the range, or an empty view if the timeout expired
+        * or if the file couldn't be mapped.
+        */
+        mapped_view map_data(size_t offset, size_t length, int timeout);
+
        /**
         * This function checks whether or not the specified data has been
         * downloaded.
@@ -152,6 +266,20 @@ namespace libcow {
          */
         size_t bytes_available(size_t offset) const;
 
+        /**
+         * Finds the first piece at or after the specified piece that
+         * hasn't been downloaded yet. This function is non-blocking and
+         * runs in logarithmic time.
+         *
+         * @param piece_index the index of the piece to start looking from
+         * @return the index of the first missing piece, or num_pieces()
+         *         if all the remaining pieces have been downloaded
+         */
+        int next_missing_piece(int piece_index) const
+        {
+            return availability_.next_missing_piece(piece_index);
+        }
+
         /**
          * This function sets the current playback position, i.e the region
          * of the file that libcow should prioritize for download. The piece at
@@ -172,6 +300,30 @@ namespace libcow {
             worker_->set_playback_position(offset, force_request);
         }
 
+       /**
+        * Sets the byte position of a named playback cursor, for when several
+        * consumers, e.g. a player and a thumbnail strip, play the file at the
+        * same time. Each cursor gets a critical window of its own, and the
+        * windows are merged into one set of piece priorities. The cursor
+        * that set_playback_position(offset) moves is called
+        * download_control_worker::default_cursor.
+        *
+        * @param cursor The name of the cursor, which is created if it doesn't exist.
+        * @param offset The byte offset of the playback position of the cursor.
+        * @param force_request Allow possibly redundant requests.
+        */
+        void set_playback_position(const std::string& cursor, size_t offset, bool force_request = false) {
+            worker_->set_playback_position(cursor, offset, force_request);
+        }
+
+       /**
+        * Removes a playback cursor that was created by set_playback_position.
+        * @param cursor The name of the cursor.
+        */
+        void remove_playback_cursor(const std::string& cursor) {
+            worker_->remove_playback_cursor(cursor);
+        }
+
        /**
         * Returns the length of a piece.
         * @return The piece length in bytes.
@@ -249,6 +401,48 @@ namespace libcow {
             worker_->set_critical_window(length);
         }
 
+        /**
+         * Sets the length of the critical window in seconds of media. The
+         * bitrate of the stream is estimated from the playback position
+         * updates, and the window is stretched when the download sources
+         * are slower than the stream. The length set by set_critical_window
+         * is used as a minimum.
+         *
+         * @param seconds The length, in seconds, of the critical window
+         */
+        void set_critical_window_duration(double seconds)
+        {
+            worker_->set_critical_window_duration(seconds);
+        }
+
+        /**
+         * Sets how the pieces around the playback position are scheduled.
+         * With download_control_worker::deadline_scheduling, each piece in
+         * the critical window gets a libtorrent deadline from when playback
+         * is expected to reach it, and pieces that are likely to miss their
+         * deadline are requested from the random access devices right away.
+         * The default is download_control_worker::priority_scheduling.
+         *
+         * @param mode The scheduling mode
+         */
+        void set_scheduling_mode(download_control_worker::scheduling_mode mode)
+        {
+            worker_->set_scheduling_mode(mode);
+        }
+
+        /**
+         * Turns on seek prefetching: the places that playback most often
+         * seeks to are learned and downloaded ahead while there is bandwidth
+         * to spare. The seek history is kept in the specified file between
+         * sessions, e.g. filename() + ".seeks". It is off by default.
+         *
+         * @param path The path of the seek history file
+         */
+        void set_seek_history_file(const std::string& path)
+        {
+            worker_->set_seek_history_file(path);
+        }
+
         /**
         * Adds a function to be called when new pieces are added.
         * @param func A callback function of type void(int).
@@ -265,6 +459,27 @@ namespace libcow {
             event_handler_->unset_piece_finished_callback();
         }
 
+        /**
+        * Adds a function to be called with all pieces added since its
+        * previous call, as (piece index, source) pairs. Use this instead of
+        * set_piece_finished_callback when pieces arrive in large bursts.
+        * @param func A callback function.
+        * @param flush_interval The minimum time in milliseconds between two calls.
+        */
+        void set_pieces_finished_callback(
+            const boost::function<void(const download_control_event_handler::piece_finished_batch&)>& func,
+            int flush_interval = download_control_event_handler::default_flush_interval)
+        {
+            event_handler_->set_pieces_finished_callback(func, flush_interval);
+        }
+
+        /**
+        * Removes the batched 'pieces finished' callback.
+        */
+        void unset_pieces_finished_callback() {
+            event_handler_->unset_pieces_finished_callback();
+        }
+
         /**
          * Calling this functions is a hint to the download control that
          * we want pieces fast and don't want to time out before hitting
@@ -273,6 +488,19 @@ namespace libcow {
         void set_buffering_state() {
             worker_->set_buffering_state();
         }
+        /**
+         * Sets the number of pieces to keep in the in-memory piece cache.
+         * Pieces delivered by download_devices are kept in the cache so
+         * that they can be read before libtorrent has written them to disk.
+         * Set the size to 0 to disable the cache.
+         *
+         * @param num_pieces The maximum number of cached pieces.
+         */
+        void set_piece_cache_size(size_t num_pieces)
+        {
+            cache_.set_max_pieces(num_pieces);
+        }
+
         /**
          * Prints useful debug information
          */
@@ -298,6 +526,41 @@ namespace libcow {
         */
         bool get_current_state(std::vector<int>& state);
 
+       /**
+        * Fills the specified vector with piece_origin data as runs of pieces
+        * with the same source. Unlike get_current_state, this function
+        * doesn't block.
+        * @param runs The vector to fill with data.
+        * @return The version of the snapshot, to pass to get_origin_changes.
+        */
+        boost::uint64_t get_origin_snapshot(
+            std::vector<download_control_event_handler::origin_run>& runs);
+
+       /**
+        * Fills the specified vector with the (piece index, source) changes
+        * to the piece_origin data since the specified version. This function
+        * doesn't block.
+        * @param since A version returned by get_origin_snapshot or
+        * get_origin_changes.
+        * @param changes The vector to fill with data.
+        * @param version Set to the version that includes the returned changes.
+        * @return True if the changes could be retrieved, false if a new
+        * snapshot is needed.
+        */
+        bool get_origin_changes(boost::uint64_t since,
+                                std::vector<std::pair<int,int> >& changes,
+                                boost::uint64_t& version);
+
+       /**
+        * Returns the state table of the pieces. It can be read from any
+        * thread without blocking, e.g. to draw the origin of each piece.
+        * @return The piece_state_table of this download_control.
+        */
+        const piece_state_table& piece_states() const
+        {
+            return piece_states_;
+        }
+
        /**
         * Returns a map from download_device id to the name of the download_device.
         * @return the map
@@ -305,17 +568,87 @@ namespace libcow {
         std::map<int,std::string> get_device_names();
 
     private:
+       /**
+        * A reader blocked in read_data, waiting for the pieces
+        * first_piece to last_piece (inclusive) to be downloaded.
+        */
+        class read_waiter
+        {
+        public:
+            read_waiter(int first, int last)
+                : first_piece(first),
+                  last_piece(last) {} // empty
+
+            int first_piece;
+            int last_piece;
+            boost::condition_variable cond;
+        };
+
+       /**
+        * A read started by async_read that waits for the pieces
+        * first_piece to last_piece (inclusive) to be downloaded.
+        */
+        class pending_read
+        {
+        public:
+            pending_read(int first, int last, size_t off, 
+                         libcow::utils::buffer buf, read_handler func)
+                : first_piece(first),
+                  last_piece(last),
+                  offset(off),
+                  buffer(buf),
+                  handler(func) {} // empty
+
+            int first_piece;
+            int last_piece;
+            size_t offset;
+            libcow::utils::buffer buffer;
+            read_handler handler;
+        };
+
+        typedef bool (download_control::*data_predicate)(size_t, size_t);
+
+        bool wait_for_data(size_t offset, size_t length, int timeout, data_predicate ready);
+        bool is_readable(size_t offset, size_t length);
+        size_t read_bytes(size_t offset, char* dest, size_t length);
+        size_t read_file(size_t offset, char* dest, size_t length);
+        size_t read_file(size_t offset, const std::vector<libcow::utils::buffer>& buffers);
+        bool open_file();
+        void advise_file(size_t offset, size_t length, file_reader::access_hint hint);
+        void wake_read_waiters(int piece_index);
+        void handle_async_read(size_t offset, libcow::utils::buffer buffer, read_handler handler);
+        static void set_read_result(boost::shared_ptr<boost::promise<size_t> > promise, size_t bytes);
+
         void signal_startup_complete() {
+            // the only time the bitfield is fetched from libtorrent,
+            // after this it is kept up to date from the alerts
+            if(handle_.is_seed()) {
+                availability_.set_all();
+                piece_states_.set_all_have();
+            } else {
+                libtorrent::bitfield pieces = handle_.status().pieces;
+                availability_.reset(pieces);
+                piece_states_.reset_have(pieces);
+            }
             event_handler_->signal_startup_complete();
+            // pieces found on disk don't generate piece_finished alerts
+            wake_read_waiters(-1);
         }
         
         void signal_piece_finished(int piece_index) {
+            availability_.set_piece(piece_index, true);
+            piece_states_.set_have(piece_index, true);
             event_handler_->signal_piece_finished(piece_index);
+            wake_read_waiters(piece_index);
         }
 
         void handle_hash_failed(int piece_index) {
+            availability_.set_piece(piece_index, false);
+            piece_states_.set_have(piece_index, false);
+            piece_states_.clear_added(piece_index);
+            cache_.erase(piece_index);
             event_handler_->handle_hash_failed(piece_index);
-            worker_->set_piece_requested(piece_index, false);
+            worker_->report_hash_failed(piece_index);
         }
 
         void set_piece_src(int source, size_t piece_index) {
@@ -323,10 +656,35 @@ namespace libcow {
         }
         
         libtorrent::torrent_handle handle_;
+        piece_availability availability_;
+        piece_state_table piece_states_;
         download_control_event_handler* event_handler_;
         download_control_worker* worker_;
         
-        std::ifstream file_handle_;
+        piece_cache cache_;
+
+        // taken from the torrent_info once, so that readers don't have
+        // to go through the torrent_handle
+        int piece_size_;
+        size_t file_size_;
+
+        // file_ is opened once under file_mutex_, after that file_open_ is
+        // set and any number of threads can read without locking
+        boost::mutex file_mutex_;
+        boost::atomic<bool> file_open_;
+        file_reader file_;
+
+        // guards file_mapping_
+        boost::mutex mapping_mutex_;
+        boost::scoped_ptr<boost::interprocess::file_mapping> file_mapping_;
+
+        // guards read_waiters_ and pending_reads_
+        boost::mutex waiter_mutex_;
+        std::list<read_waiter*> read_waiters_;
+        std::list<pending_read> pending_reads_;
+
+        // carries out async reads and invokes their handlers
+        dispatcher* reader_;
 
         int id_;
         std::string download_dir_;
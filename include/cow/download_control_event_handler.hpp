@@ -5,20 +5,68 @@
 #include <libtorrent/alert.hpp>
 #include <libtorrent/torrent_handle.hpp>
 
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <deque>
+#include <utility>
+#include <vector>
+
 namespace libcow 
 {
     class chunk;
+    class piece_availability;
+    class piece_state_table;
    /**
     * This class handles events from libcow::download_control:s.
     */
     class download_control_event_handler
     {
     public:
+       /**
+        * A batch of finished pieces, as (piece index, source) pairs.
+        */
+        typedef std::vector<std::pair<int,int> > piece_finished_batch;
+
+       /**
+        * The default flush interval, in milliseconds, for
+        * set_pieces_finished_callback.
+        */
+        static const int default_flush_interval = 100;
+
+       /**
+        * The number of piece_origin changes that are kept for
+        * get_origin_changes. Callers that fall further behind than this
+        * have to fetch a new snapshot.
+        */
+        static const size_t max_origin_changes = 4096;
+
+       /**
+        * A run of consecutive pieces with the same piece_origin.
+        */
+        struct origin_run
+        {
+            origin_run(int first, int num, int src)
+                : first_piece(first),
+                  num_pieces(num),
+                  source(src) {} // empty
+
+            int first_piece;
+            int num_pieces;
+            int source;
+        };
+
        /**
         * Creates a new download_control_event_handler and initializes some variables.
         * @param h The torrent_handle that this download_control_event_handler belongs to.
+        * @param availability The pieces that have been downloaded.
+        * @param piece_states The table that the piece origins are stored in.
         */
-        download_control_event_handler(libtorrent::torrent_handle& h);
+        download_control_event_handler(libtorrent::torrent_handle& h,
+                                       const piece_availability& availability,
+                                       piece_state_table& piece_states);
         ~download_control_event_handler();
     
        /**
@@ -74,6 +122,23 @@ namespace libcow
         */
         void unset_piece_finished_callback();
 
+       /**
+        * Sets a callback that is called with every piece finished since the
+        * previous call, instead of once per piece. The callback is called at
+        * most once per flush interval, and not at all while no pieces finish.
+        * It can be used together with set_piece_finished_callback.
+        * @param func The function to call.
+        * @param flush_interval The minimum time in milliseconds between two calls.
+        */
+        void set_pieces_finished_callback(const boost::function<void(const piece_finished_batch&)>& func,
+                                          int flush_interval = default_flush_interval);
+
+       /**
+        * Removes the pieces_finished_callback. Pieces that have finished but
+        * not been flushed yet are dropped. This function is blocking.
+        */
+        void unset_pieces_finished_callback();
+
        /**
         * Fills the specified vector with piece_origin data. This function
         * is blocking.
@@ -82,28 +147,67 @@ namespace libcow
         * otherwise false.
         */
         bool get_current_state(std::vector<int>& state);
+
+       /**
+        * Fills the specified vector with the piece_origin data as runs of
+        * pieces with the same source. This function doesn't wait for the
+        * event handler thread.
+        * @param runs The vector to fill with data.
+        * @return The version of the snapshot, to pass to get_origin_changes.
+        */
+        boost::uint64_t get_origin_snapshot(std::vector<origin_run>& runs);
+
+       /**
+        * Fills the specified vector with the (piece index, source) changes
+        * made to the piece_origin data since the specified version, in the
+        * order they were made. This function doesn't wait for the event
+        * handler thread.
+        * @param since The version returned by a previous get_origin_snapshot
+        * or get_origin_changes call.
+        * @param changes The vector to fill with data.
+        * @param version Set to the version that includes the returned changes.
+        * @return True if the changes could be retrieved, false if since is
+        * too old, in which case a new snapshot is needed.
+        */
+        bool get_origin_changes(boost::uint64_t since,
+                                std::vector<std::pair<int,int> >& changes,
+                                boost::uint64_t& version);
     private:
-        class piece_request
+       /**
+        * A pending invoke_when_downloaded call. The waiter is shared by the
+        * waiter lists of all pieces it is still missing and counts down as
+        * those pieces finish.
+        */
+        class piece_waiter
         {
         public:
             typedef boost::function<void(std::vector<int>)> callback;
-            
-            piece_request(std::list<int>* pieces, callback func, std::vector<int>* org_pieces)
+
+            piece_waiter(const std::vector<int>& pieces, callback func, int outstanding)
                 : pieces_(pieces),
                   callback_(func),
-                  org_pieces_(org_pieces) {} // empty
-            
-            std::list<int>* pieces_;
+                  outstanding_(outstanding) {} // empty
+
+            std::vector<int> pieces_;
             callback callback_;
-            std::vector<int>* org_pieces_;
+            boost::atomic<int> outstanding_;
         };
 
+        typedef boost::shared_ptr<piece_waiter> piece_waiter_ptr;
+
         void handle_set_piece_src(int source, size_t piece_index);
         void handle_invoke_after_init(boost::function<void(void)> callback);
+        void post_invoke_when_downloaded(const std::vector<chunk>& chunks, 
+                                         boost::function<void(std::vector<int>)> callback);
         void handle_invoke_when_downloaded(const std::vector<chunk>& chunks, 
                                            boost::function<void(std::vector<int>)> callback);
         void handle_set_piece_finished_callback(const boost::function<void(int,int)>& func);
         void handle_unset_piece_finished_callback();
+        void handle_set_pieces_finished_callback(const boost::function<void(const piece_finished_batch&)>& func,
+                                                 int flush_interval);
+        void handle_unset_pieces_finished_callback();
+        void handle_piece_finished(int piece_index);
+        void flush_finished_pieces();
         bool handle_get_current_state(std::vector<int>& state);
         void internal_handle_hash_failed(int piece_index);
         void signal_startup_callbacks();
@@ -112,17 +216,31 @@ namespace libcow
         void invoke_piece_finished_callback(int piece_index, int device);
         std::vector<int> missing_pieces(const std::vector<int>& pieces);
         void set_disk_source();
+        void set_piece_origin(int piece_index, int source);
 
         dispatcher* disp_;
         dispatcher* callback_worker_;
         libtorrent::torrent_handle& torrent_handle_;
+        const piece_availability& availability_;
+        piece_state_table& piece_states_;
 
-        std::multimap<int, piece_request> piece_nr_to_request_;
+        // waiters indexed by the piece they are waiting for
+        std::vector<std::vector<piece_waiter_ptr> > piece_waiters_;
 
         std::vector<boost::function<void(void)> > startup_complete_callbacks_;
         boost::function<void(int,int)> piece_finished_callback_;
 
-        std::vector<int> piece_origin_;
+        boost::function<void(const piece_finished_batch&)> pieces_finished_callback_;
+        piece_finished_batch finished_batch_;
+        int flush_interval_;
+        bool flush_scheduled_;
+        dispatcher::timer_id flush_timer_;
+
+        // the origins in piece_states_ are written on the event handler
+        // thread only, under origin_mutex_, together with the change log
+        std::deque<std::pair<int,int> > origin_changes_;
+        boost::uint64_t origin_changes_base_;
+        boost::mutex origin_mutex_;
 
         bool is_libtorrent_ready_;
     };
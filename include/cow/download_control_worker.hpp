@@ -1,15 +1,26 @@
 #ifndef ___libcow_download_control_worker___
 #define ___libcow_download_control_worker___
 
+#include <cow/device_statistics.hpp>
+#include <cow/file_reader.hpp>
+#include <cow/rate_estimator.hpp>
+#include <cow/seek_prefetcher.hpp>
 #include <libtorrent/torrent_handle.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
 #include <exception>
 #include <string>
+#include <map>
+#include <vector>
 
 namespace libcow 
 {
     class download_device;
     class dispatcher;
     class chunk;
+    class piece_availability;
+    class piece_state_table;
+    struct piece_request;
 
    /**
     * This class is responsible for carrying out jobs for the
@@ -18,13 +29,42 @@ namespace libcow
     class download_control_worker
     {
     public:
+       /**
+        * The type of the function used to pass readahead hints for a byte
+        * range of the downloaded file on to the operating system.
+        */
+        typedef boost::function<void(size_t, size_t, file_reader::access_hint)> readahead_handler;
+
+       /**
+        * How the pieces around the playback position are scheduled.
+        */
+        enum scheduling_mode {
+            /** 
+             * The pieces in the critical window get fixed priority tiers.
+             */
+            priority_scheduling,
+            /** 
+             * In addition to the priorities, each piece in the critical window
+             * gets a deadline from when the playback is expected to reach it,
+             * and pieces that are about to miss their deadline are requested
+             * from the random access devices right away.
+             */
+            deadline_scheduling
+        };
+
        /**
         * Creates a new download_control_worker.
         * @param h The torrent_handle that this worker belongs to.
+        * @param availability The pieces that have been downloaded.
+        * @param piece_states The table that the requested pieces are marked in.
         * @param critical_window_length The number of pieces that are critical to download.
-        * @param critical_window_timeout The timeout in seconds to use for dispatcher jobs.
+        * @param critical_window_timeout The time in milliseconds that bittorrent gets
+        * to download a piece in the critical window, and that a random access
+        * device gets before the piece is requested from another device as well.
         */
         download_control_worker(libtorrent::torrent_handle& h,
+                                const piece_availability& availability,
+                                piece_state_table& piece_states,
                                 size_t critical_window_length,
                                 int critical_window_timeout);
         ~download_control_worker();
@@ -34,11 +74,51 @@ namespace libcow
         * @param num_pieces The number of critical pieces.
         */
         void set_critical_window(size_t length);
+
+       /**
+        * Sets the length of the critical window in seconds of media. The
+        * window is sized from the bitrate that is estimated from the
+        * playback position updates, and stretched when the sources deliver
+        * slower than that bitrate. The window set by set_critical_window
+        * is used as a minimum, and until the bitrate is known.
+        * @param seconds The length of the critical window in seconds.
+        */
+        void set_critical_window_duration(double seconds);
+
+       /**
+        * Sets how the pieces around the playback position are scheduled.
+        * The default is priority_scheduling.
+        * @param mode The scheduling mode.
+        */
+        void set_scheduling_mode(scheduling_mode mode);
+
+       /**
+        * Counts pieces that a download_device has delivered, for measuring
+        * the latency, throughput and error rate of the device.
+        * @param device_id The id of the download_device.
+        * @param pieces The indices of the pieces that were delivered.
+        * @param bytes The number of bytes that were delivered.
+        * @param num_rejected The number of delivered pieces that were broken.
+        */
+        void report_pieces_received(int device_id, 
+                                    const std::vector<int>& pieces, 
+                                    size_t bytes,
+                                    int num_rejected);
+
+       /**
+        * Reports that a piece failed the hash check. The piece may be requested
+        * again, and the device that delivered it is charged with an error.
+        * @param piece_index The index of the piece.
+        */
+        void report_hash_failed(int piece_index);
        
         /**
          * This sets the timeout for the pieces in the critical 
          * window. Note that this function is asynchronous, 
-         * the timeout will changes as soon as possible
+         * the timeout will changes as soon as possible.
+         * Pieces that have been requested from a random access device for
+         * longer than this are requested from another device as well, and
+         * whichever copy arrives last is dropped.
          *
          * @param timeout the new timeout in ms
          */ 
@@ -65,6 +145,12 @@ namespace libcow
          */
         void set_piece_requested(int piece_index, bool req);
 
+       /**
+        * The name of the cursor that is moved by set_playback_position
+        * when no cursor is named.
+        */
+        static const std::string default_cursor;
+
        /**
         * Sets the current byte position for playing back movies. This function is used to
         * indicate wich pieces needs to be downloaded soon.
@@ -72,9 +158,49 @@ namespace libcow
         * @param force_request True if we should request pieces that we already have requested before.
         */
         void set_playback_position(size_t offset, bool force_request);
+
+       /**
+        * Sets the byte position of a named playback cursor, for when several
+        * consumers play the file at the same time. Each cursor has a critical
+        * window of its own, and the windows of all cursors are merged into one
+        * set of piece priorities and one plan for the random access devices.
+        * A cursor is created the first time it is moved. The readahead hints
+        * only follow the default cursor.
+        * @param cursor The name of the cursor.
+        * @param offset The current playback position of the cursor.
+        * @param force_request True if we should request pieces that we already have requested before.
+        */
+        void set_playback_position(const std::string& cursor, size_t offset, bool force_request);
+
+       /**
+        * Removes a playback cursor. The pieces in its window go back to the
+        * normal priority, unless another cursor needs them.
+        * @param cursor The name of the cursor.
+        */
+        void remove_playback_cursor(const std::string& cursor);
         
         void set_buffering_state();
 
+       /**
+        * Sets the function to call with readahead hints. When the playback
+        * position changes, the downloaded pieces right after it are hinted
+        * as will_need and the pieces that have been played as dont_need.
+        * @param handler The function to call with the hints.
+        */
+        void set_readahead_handler(const readahead_handler& handler);
+
+       /**
+        * Sets the file that the seek history of the program is kept in. The
+        * history is loaded from the file right away, and saved to it when
+        * the worker is destroyed, unless no seeks have been recorded. Seeks
+        * are only learned from and prefetched once a file has been set.
+        * While the critical windows are full and no random access requests
+        * are outstanding, the pieces at the places that the default cursor
+        * most often seeks to are downloaded ahead.
+        * @param path The path of the file.
+        */
+        void set_seek_history_file(const std::string& path);
+
 
        /**
         * Returns a map from download_device id to the name of the download_device.
@@ -83,39 +209,187 @@ namespace libcow
         std::map<int,std::string> get_device_names();
 
     private:
+       /**
+        * A get_pieces request to a random access device whose pieces
+        * haven't all arrived yet.
+        */
+        class request_batch
+        {
+        public:
+            request_batch(int device, const boost::posix_time::ptime& time, 
+                          size_t size, int count)
+                : device_id(device),
+                  sent(time),
+                  bytes(size),
+                  first_bytes(0),
+                  pieces_left(count),
+                  failed(false) {} // empty
+
+            int device_id;
+            boost::posix_time::ptime sent;
+            boost::posix_time::ptime first_arrival;
+            size_t bytes;
+            // the bytes that arrived together with the first piece
+            size_t first_bytes;
+            int pieces_left;
+            bool failed;
+        };
+
+       /**
+        * A playback position, and the window of pieces that is prioritized for it.
+        */
+        class playback_cursor
+        {
+        public:
+            playback_cursor()
+                : offset(0),
+                  first_piece(0),
+                  num_window_pieces(0),
+                  end_piece(0),
+                  bitrate_sample_offset(0) {} // empty
+
+            size_t offset;
+            int first_piece;
+            // the number of pieces in the critical window
+            int num_window_pieces;
+            // the end of the critical window and its tail of lower priorities
+            int end_piece;
+            // the position and time that the next bitrate sample is measured from
+            size_t bitrate_sample_offset;
+            boost::posix_time::ptime bitrate_sample_time;
+            // when the cursor was last moved
+            boost::posix_time::ptime updated;
+        };
+
+        // the pieces [first, end)
+        typedef std::pair<int, int> piece_range;
+
         void handle_set_critical_window(size_t length);
+        void handle_set_critical_window_duration(double seconds);
+        void handle_set_scheduling_mode(scheduling_mode mode);
+        double time_until_played(size_t offset, int piece_index, int num_window_pieces);
+        void update_deadlines();
+        void clear_deadlines();
+        int last_late_piece(size_t offset, int first_piece, int num_pieces);
+        void handle_report_pieces_received(int device_id, 
+                                           const std::vector<int>& pieces, 
+                                           size_t bytes,
+                                           int num_rejected);
+        void handle_report_hash_failed(int piece_index);
+        typedef std::pair<download_device*, std::vector<libcow::piece_request> > request_stripe;
+
+        void stripe_requests(const std::vector<libcow::piece_request>& reqs,
+                             std::vector<request_stripe>& stripes,
+                             int excluded_device);
+        void send_requests(download_device* dev,
+                           const std::vector<libcow::piece_request>& reqs,
+                           const boost::posix_time::ptime& now,
+                           bool hedge);
+        void expire_requests(const boost::posix_time::ptime& now);
+        void hedge_late_requests(int first_piece, 
+                                 int last_piece, 
+                                 const boost::posix_time::ptime& now);
+        void drop_request(std::multimap<int, boost::shared_ptr<request_batch> >::iterator it);
+        void cancel_stale_requests(const std::vector<piece_range>& old_windows);
+        void cancel_device_pieces(const std::map<int, std::vector<int> >& pieces);
+        void update_bitrate(playback_cursor& cursor, size_t offset);
+        double source_throughput();
+        size_t critical_window_bytes();
+        bool window_has_demand(size_t window_bytes);
         void handle_set_critical_window_timeout(int timeout);
         void handle_add_download_device(download_device* dd);
-        void handle_set_playback_position(size_t offset, bool force_request);
+        void handle_set_playback_position(const std::string& cursor, size_t offset, bool force_request);
+        void handle_remove_playback_cursor(const std::string& cursor);
+        void handle_pre_buffer(const chunk& c);
         
-        void handle_download_strategy(const chunk& c, 
-                                      bool force_request, 
-                                      bool pre_buffer);
+        void update_strategy(const std::vector<piece_range>& old_windows, bool force_request);
+        void cursor_windows(std::vector<piece_range>& windows);
+        bool in_cursor_window(int piece_index);
+        bool has_random_access_device();
+        void reset_desired_priorities();
+        int prioritize_window(int first_piece, int num_window_pieces);
+        int window_priority(int piece_index, int first_piece, int num_window_pieces);
+        int background_priority(int piece_index);
+        void apply_desired_priorities();
         
         void handle_set_piece_requested(int piece_index, bool req);
         std::map<int,std::string> handle_get_device_names();
         
-        void fetch_missing_pieces(download_device* dev,
-                                  int first_piece,
-                                  int last_piece,
-                                  bool force_request,
-                                  boost::system::error_code& error);
+        void fetch_missing_pieces(const std::vector<piece_range>& ranges, bool force_request);
+        void fetch_window_pieces(const std::vector<piece_range>& windows, bool force_request);
         void handle_set_buffering_state();
+        void handle_set_readahead_handler(const readahead_handler& handler);
+        void update_readahead(size_t offset);
+        void handle_set_seek_history_file(const std::string& path);
+        bool is_seek(const playback_cursor& cursor, size_t offset, const boost::posix_time::ptime& now);
+        void prefetch_seek_targets();
 
         std::vector<boost::shared_ptr<download_device> > download_devices_;
 
-        std::vector<bool> critically_requested_;
-        
+        // the minimum critical window in bytes
         size_t critical_window_;
+        // the critical window in seconds of media
+        double critical_window_duration_;
+        // in ms, see set_critical_window_timeout
+        int critical_window_timeout_;
+
+        // the estimated bitrate of the stream in bytes per second, 0 if unknown
+        double bitrate_;
+
+        // the playback cursors, by name
+        std::map<std::string, playback_cursor> cursors_;
+
+        // the throughput of each random access device, by device id
+        std::map<int, rate_estimator> device_rates_;
+        // the bittorrent payload rate, refreshed at most once per second
+        double bittorrent_rate_;
+        boost::posix_time::ptime bittorrent_rate_time_;
+
+        // the performance of each random access device, by device id
+        std::map<int, device_statistics> device_stats_;
+        // the requests that are waiting for pieces, by piece index. A piece
+        // has two requests when the first one was late and has been hedged.
+        std::multimap<int, boost::shared_ptr<request_batch> > outstanding_requests_;
+        // the id of the device that delivered each piece, or -1
+        std::vector<int> delivered_by_;
+
+        // the piece priorities that were last handed to libtorrent
+        std::vector<int> applied_priorities_;
+        // scratch space for working out the new priorities
+        std::vector<int> desired_priorities_;
+        // the highest window priority each piece got from pre_buffer, or 0
+        std::vector<int> pre_buffer_priorities_;
+
+        scheduling_mode scheduling_mode_;
+        // the deadlines that have been handed to libtorrent, by piece index
+        std::map<int, boost::posix_time::ptime> piece_deadlines_;
 
         libtorrent::torrent_handle torrent_handle_;
 
+        const piece_availability& availability_;
+        piece_state_table& piece_states_;
+
         dispatcher* disp_;
 
         bool is_running_;
 
         unsigned int buffering_state_counter_;
         static unsigned int buffering_state_length_;
+
+        readahead_handler readahead_handler_;
+        // the first piece of the previous playback position
+        int readahead_piece_;
+        // the bytes before will_need_end_ have been hinted as will_need
+        size_t will_need_end_;
+        // the bytes before dont_need_end_ have been hinted as dont_need
+        size_t dont_need_end_;
+        // the number of critical windows after the playback position to read ahead
+        static int readahead_windows_;
+
+        seek_prefetcher prefetcher_;
+        std::string seek_history_path_;
+        // the pieces that were given the prefetch priority on the last pass
+        std::vector<piece_range> prefetch_ranges_;
     };
 }
 
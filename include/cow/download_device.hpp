@@ -109,6 +109,15 @@ namespace libcow {
         */
         virtual bool get_pieces(const std::vector<libcow::piece_request> & requests) = 0;
 
+       /**
+        * This function is used by download_control to cancel requests for pieces
+        * that are no longer needed, e.g. after a seek. The pieces may still be
+        * delivered, so this is only a hint. Devices that can't cancel requests
+        * don't have to implement it.
+        * @param piece_indices The indices of the pieces that are no longer needed.
+        */
+        virtual void cancel_pieces(const std::vector<int>& piece_indices) {}
+
         /**
          * This function returns the id for this download control.
          *
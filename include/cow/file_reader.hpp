@@ -0,0 +1,121 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL COWBOYCODERS OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of CowboyCoders.
+*/
+
+#ifndef ___libcow_file_reader___
+#define ___libcow_file_reader___
+
+#include <cow/utils/buffer.hpp>
+
+#include <boost/utility.hpp>
+
+#include <string>
+#include <vector>
+
+#ifdef WIN32
+#include <Windows.h>
+#endif
+
+namespace libcow 
+{
+   /**
+    * A read-only file that is read with positional reads (pread/preadv on
+    * POSIX). Since no file position is shared between reads, any number of
+    * threads can read from the same file_reader at the same time.
+    */
+    class file_reader : public boost::noncopyable
+    {
+    public:
+       /**
+        * Hints about how a region of the file will be accessed.
+        */
+        enum access_hint {
+            will_need, /**< The region will be read soon. */
+            dont_need  /**< The region won't be read again soon. */
+        };
+
+        file_reader();
+        ~file_reader();
+
+       /**
+        * Opens the specified file for reading.
+        * @param path The path to the file.
+        * @return True if the file could be opened, otherwise false.
+        */
+        bool open(const std::string& path);
+
+       /**
+        * Closes the file.
+        */
+        void close();
+
+       /**
+        * This function returns whether or not the file is open.
+        * @return True if the file is open, otherwise false.
+        */
+        bool is_open() const;
+
+       /**
+        * Reads data from the specified offset.
+        * @param offset The byte offset to start reading from.
+        * @param dest The memory to read to.
+        * @param length The number of bytes to read.
+        * @return The number of bytes actually read, which is less than
+        * length if the end of the file was reached or an error occurred.
+        */
+        size_t read(size_t offset, char* dest, size_t length) const;
+
+       /**
+        * Reads a contiguous region of the file, starting at the specified
+        * offset, into several buffers. The buffers are filled in order.
+        * @param offset The byte offset to start reading from.
+        * @param buffers The buffers to read to.
+        * @return The total number of bytes actually read.
+        */
+        size_t read(size_t offset, const std::vector<libcow::utils::buffer>& buffers) const;
+
+       /**
+        * Tells the operating system how a region of the file will be
+        * accessed, so that it can read it into the page cache ahead of time
+        * or drop it from there. This is only a hint and does nothing on
+        * platforms without posix_fadvise.
+        * @param offset The byte offset of the region.
+        * @param length The length of the region in bytes.
+        * @param hint How the region will be accessed.
+        */
+        void advise(size_t offset, size_t length, access_hint hint) const;
+
+    private:
+#ifdef WIN32
+        HANDLE handle_;
+#else
+        int fd_;
+#endif
+    };
+}
+
+#endif // ___libcow_file_reader___
@@ -0,0 +1,228 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL COWBOYCODERS OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of CowboyCoders.
+*/
+
+#ifndef ___libcow_http_stream_server___
+#define ___libcow_http_stream_server___
+
+#include <cow/download_control.hpp>
+#include <cow/utils/buffer.hpp>
+
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include <list>
+#include <string>
+
+namespace libcow 
+{
+   /**
+    * A seekable resource that can be served by an http_stream_server.
+    * The functions are called from the threads of the server, possibly
+    * from several threads at the same time.
+    */
+    class stream_source
+    {
+    public:
+        virtual ~stream_source() {}
+
+       /**
+        * @return The total size of the resource in bytes.
+        */
+        virtual size_t size() = 0;
+
+       /**
+        * Called when a client is about to read from the specified offset.
+        * @param offset The byte offset that will be read next.
+        */
+        virtual void set_playback_position(size_t offset) = 0;
+
+       /**
+        * Reads data from offset into the buffer, waiting for at most
+        * timeout ms for the data to become available.
+        * @param offset The byte offset to start reading from.
+        * @param buffer The buffer to read data to.
+        * @param timeout The maximum time to wait for the data in ms.
+        * @return The number of bytes read, or 0 if the timeout expired.
+        */
+        virtual size_t read(size_t offset, libcow::utils::buffer& buffer, int timeout) = 0;
+
+       /**
+        * The number of sequential bytes, starting at offset, that can be
+        * sent straight from the file returned by filename().
+        * @param offset The byte offset to start counting from.
+        * @return The number of bytes.
+        */
+        virtual size_t bytes_on_disk(size_t offset) = 0;
+
+       /**
+        * @return The path of the file that holds the data on disk.
+        */
+        virtual std::string filename() = 0;
+    };
+
+   /**
+    * A stream_source that serves the file of a download_control. Sources
+    * for different consumers of the same download_control should use
+    * different playback cursors.
+    */
+    class download_control_stream_source : public stream_source
+    {
+    public:
+        download_control_stream_source(download_control& ctrl, 
+                                       const std::string& cursor = download_control_worker::default_cursor)
+            : ctrl_(ctrl),
+              cursor_(cursor) {} // empty
+
+        size_t size()
+        {
+            return ctrl_.file_size();
+        }
+
+        void set_playback_position(size_t offset)
+        {
+            ctrl_.set_playback_position(cursor_, offset);
+        }
+
+        size_t read(size_t offset, libcow::utils::buffer& buffer, int timeout)
+        {
+            return ctrl_.read_data(offset, buffer, timeout);
+        }
+
+        size_t bytes_on_disk(size_t offset)
+        {
+            return ctrl_.bytes_available(offset);
+        }
+
+        std::string filename()
+        {
+            return ctrl_.filename();
+        }
+
+    private:
+        download_control& ctrl_;
+        std::string cursor_;
+    };
+
+   /**
+    * A minimal HTTP/1.1 server that exposes a single stream_source, typically
+    * an active download_control, as a seekable resource, so that it can be
+    * played by ordinary media players. The resource is served for every path.
+    * GET and HEAD requests are supported, as well as single byte ranges
+    * (Range: bytes=first-last, first- and -suffix_length).
+    *
+    * Every request moves the playback position of the source, and so does
+    * every MB sent of a long response. Data that has been downloaded is sent
+    * straight from the file with sendfile where that is available. Each
+    * connection is served by its own thread.
+    */
+    class LIBCOW_EXPORT http_stream_server : public boost::noncopyable
+    {
+    public:
+       /**
+        * Creates a new http_stream_server for a download_control.
+        * @param ctrl The download_control to serve. It must outlive the server.
+        * @param content_type The value of the Content-Type header.
+        */
+        http_stream_server(download_control& ctrl, 
+                           const std::string& content_type = "video/MP2T");
+
+       /**
+        * Creates a new http_stream_server for any stream_source.
+        * @param source The source to serve. It must outlive the server.
+        * @param content_type The value of the Content-Type header.
+        */
+        http_stream_server(stream_source& source, 
+                           const std::string& content_type = "video/MP2T");
+
+       /**
+        * Stops the server if it is running.
+        */
+        ~http_stream_server();
+
+       /**
+        * Starts listening for connections. Throws a libcow::exception if
+        * the server couldn't listen on the specified address.
+        * @param port The port to listen on, or 0 to pick any free port.
+        * @param address The address to listen on.
+        * @return The port that the server listens on.
+        */
+        unsigned short start(unsigned short port = 0, 
+                             const std::string& address = "127.0.0.1");
+
+       /**
+        * Stops listening, closes all connections and waits for
+        * the connection threads to exit.
+        */
+        void stop();
+
+       /**
+        * @return The port that the server listens on.
+        */
+        unsigned short port() const
+        {
+            return port_;
+        }
+
+    private:
+        typedef boost::shared_ptr<boost::asio::ip::tcp::socket> socket_ptr;
+        typedef boost::shared_ptr<boost::thread> thread_ptr;
+
+        void start_accept();
+        void handle_accept(socket_ptr socket, const boost::system::error_code& error);
+        void close_acceptor();
+        void reap_connection_threads();
+        void serve(socket_ptr socket);
+        bool handle_request(boost::asio::ip::tcp::socket& socket, boost::asio::streambuf& request_buf);
+        bool send_response(boost::asio::ip::tcp::socket& socket, 
+                           const std::string& status,
+                           const std::string& headers);
+        bool send_body(boost::asio::ip::tcp::socket& socket, size_t first, size_t end);
+
+        boost::scoped_ptr<download_control_stream_source> control_source_;
+        stream_source& source_;
+        std::string content_type_;
+
+        boost::asio::io_service io_service_;
+        boost::asio::ip::tcp::acceptor acceptor_;
+        boost::thread accept_thread_;
+        unsigned short port_;
+        boost::atomic<bool> running_;
+
+        // guards sockets_
+        boost::mutex sockets_mutex_;
+        std::list<socket_ptr> sockets_;
+        // finished threads are joined when the next connection is accepted
+        std::list<thread_ptr> connection_threads_;
+    };
+}
+
+#endif // ___libcow_http_stream_server___
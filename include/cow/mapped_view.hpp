@@ -0,0 +1,91 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL COWBOYCODERS OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of CowboyCoders.
+*/
+
+#ifndef ___libcow_mapped_view___
+#define ___libcow_mapped_view___
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/shared_ptr.hpp>
+
+namespace libcow
+{
+   /**
+    * \class mapped_view
+    * A read-only view straight into the memory mapped file of a download.
+    * Each mapped_view holds a lease on its mapping, so the memory stays
+    * valid for as long as any copy of the view is alive, even if the
+    * download_control that created it has been removed.
+    */
+    class LIBCOW_EXPORT mapped_view
+    {
+    public:
+       /**
+        * Creates an empty view.
+        */
+        mapped_view() {} // empty
+
+       /**
+        * Creates a view of the specified mapped region.
+        * @param region The mapped region to hold a lease on.
+        */
+        mapped_view(boost::shared_ptr<boost::interprocess::mapped_region> region)
+            : region_(region) {} // empty
+
+       /**
+        * Returns a pointer to the first byte of the view.
+        * @return A pointer to the data, or 0 if the view is empty.
+        */
+        const char* data() const
+        {
+            return region_ ? static_cast<const char*>(region_->get_address()) : 0;
+        }
+
+       /**
+        * Returns the size of the view.
+        * @return The size in bytes.
+        */
+        size_t size() const
+        {
+            return region_ ? region_->get_size() : 0;
+        }
+
+       /**
+        * Returns whether or not this view maps any data.
+        * @return True if the view is empty, otherwise false.
+        */
+        bool empty() const
+        {
+            return size() == 0;
+        }
+
+    private:
+        boost::shared_ptr<boost::interprocess::mapped_region> region_;
+    };
+}
+
+#endif // ___libcow_mapped_view___
@@ -43,6 +43,7 @@ or implied, of CowboyCoders.
 #include <boost/asio.hpp>
 
 #include <iostream>
+#include <list>
 #include <map>
 
 namespace libcow {
@@ -52,6 +53,12 @@ namespace libcow {
     * This download_device is capable of requesting data pieces from
     * server using curl calls. It can be used as a source for
     * when pieces needs to be downloaded urgently.
+    *
+    * By default, the pieces are requested with the Size and Indices headers
+    * that the libcow on demand server understands. With the setting
+    * range_requests=true, each run of consecutive pieces is instead 
+    * requested with an HTTP Range header, which any HTTP server serving
+    * the file supports.
     */
     class LIBCOW_EXPORT on_demand_server_connection 
         : public libcow::download_device
@@ -120,6 +127,14 @@ namespace libcow {
          * @return True if it was possible to get the pieces, otherwise false.
          */
          virtual bool get_pieces(const std::vector<piece_request> & requests);
+
+        /**
+         * This function cancels the requests for pieces that are no longer needed.
+         * Requests that haven't been sent yet are dropped, and a transfer that
+         * is in progress is aborted once all its pieces have been cancelled.
+         * @param piece_indices The indices of the pieces that are no longer needed.
+         */
+         virtual void cancel_pieces(const std::vector<int>& piece_indices);
         
         /**
          * This function returns the id for this download control.
@@ -142,18 +157,44 @@ namespace libcow {
         }
 
     private:         
+         /**
+          * The pieces of a request that has been queued or sent, and 
+          * which of them have been cancelled.
+          */
+         struct pending_request
+         {
+             pending_request(const std::vector<int>& piece_indices)
+                 : indices(piece_indices),
+                   cancelled(piece_indices.size(), false),
+                   num_cancelled(0) {} // empty
+
+             std::vector<int> indices;
+             std::vector<bool> cancelled;
+             size_t num_cancelled;
+         };
+
          properties settings_;
          bool is_open_;
          response_handler_function handler_;
          bool is_random_access_;
          bool is_stream_;
          bool is_readable_;
+         bool range_requests_;
          
          std::string connection_string_;
          // worker thread function
          void worker(std::string connection_str,
                      const std::size_t piece_size,
-                     const std::vector<int>& indices);
+                     boost::shared_ptr<pending_request> request);
+         void perform_request(std::string connection_str,
+                              const std::size_t piece_size,
+                              boost::shared_ptr<pending_request> request);
+
+         bool is_cancelled(boost::shared_ptr<pending_request> request);
+
+         // protects pending_requests_, which is shared with the worker threads
+         boost::mutex pending_mutex_;
+         std::list<boost::shared_ptr<pending_request> > pending_requests_;
 
 
          // 'work' needs io_service for init.
@@ -0,0 +1,141 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL COWBOYCODERS OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of CowboyCoders.
+*/
+
+#ifndef ___libcow_piece_availability___
+#define ___libcow_piece_availability___
+
+#include <libtorrent/bitfield.hpp>
+
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/utility.hpp>
+
+namespace libcow 
+{
+   /**
+    * A thread safe copy of the torrent's piece bitfield. It is initialized
+    * from libtorrent once the torrent has been checked, and then kept up to
+    * date from the piece_finished and hash_failed alerts, so that queries
+    * never have to make a round-trip into the libtorrent network thread.
+    *
+    * The pieces are stored as the leaves of a segment tree where each inner
+    * node tells whether all pieces below it are available. This makes it
+    * possible to find the next missing piece, and thus check whether a range
+    * is available, in logarithmic time.
+    *
+    * The queries never lock, so any number of readers can use them at the
+    * same time. This relies on there being a single writer: all the modifying
+    * functions must be called from the same thread, which for a
+    * download_control is the thread of the cow_client_worker that delivers
+    * the alerts. While a piece is being updated, a range query may briefly
+    * disagree with has_piece about that piece.
+    */
+    class piece_availability : public boost::noncopyable
+    {
+    public:
+       /**
+        * Creates a new piece_availability where no pieces are available.
+        * @param num_pieces The number of pieces in the torrent.
+        */
+        piece_availability(int num_pieces);
+
+       /**
+        * Replaces the availability of all pieces.
+        * @param pieces The bitfield to copy, e.g. from torrent_status.
+        */
+        void reset(const libtorrent::bitfield& pieces);
+
+       /**
+        * Marks all pieces as available.
+        */
+        void set_all();
+
+       /**
+        * Sets whether or not a piece is available.
+        * @param piece_index The index of the piece.
+        * @param have True if the piece is available, otherwise false.
+        */
+        void set_piece(int piece_index, bool have);
+
+       /**
+        * Checks whether or not a piece is available.
+        * @param piece_index The index of the piece.
+        * @return True if the piece is available, otherwise false.
+        */
+        bool has_piece(int piece_index) const;
+
+       /**
+        * Checks whether or not a range of pieces are available.
+        * @param first_piece The index of the first piece in the range.
+        * @param last_piece The index of the last piece in the range (inclusive).
+        * @return True if all the pieces are available, otherwise false.
+        */
+        bool has_pieces(int first_piece, int last_piece) const;
+
+       /**
+        * Finds the first piece at or after the specified index that isn't
+        * available.
+        * @param piece_index The index of the piece to start looking from.
+        * @return The index of the first missing piece, or num_pieces() if
+        * all pieces from piece_index to the end are available.
+        */
+        int next_missing_piece(int piece_index) const;
+
+       /**
+        * Checks whether or not all pieces are available.
+        * @return True if all the pieces are available, otherwise false.
+        */
+        bool is_complete() const;
+
+       /**
+        * @return The number of pieces in the torrent.
+        */
+        int num_pieces() const
+        {
+            return num_pieces_;
+        }
+
+    private:
+        void update_parents(int node);
+        void update_inner_nodes();
+        int find_next_missing(int piece_index) const;
+
+        int num_pieces_;
+        boost::atomic<int> num_available_;
+
+        // number of leaves, the smallest power of two >= num_pieces_
+        int num_leaves_;
+
+        // tree_[1] is the root, the children of node n are 2n and 2n+1 and
+        // piece i is stored in tree_[num_leaves_ + i]. A node is 1 if all
+        // the pieces below it are available. Padding leaves are always 0.
+        boost::scoped_array<boost::atomic<unsigned char> > tree_;
+    };
+}
+
+#endif // ___libcow_piece_availability___
@@ -0,0 +1,113 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL COWBOYCODERS OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of CowboyCoders.
+*/
+
+#ifndef ___libcow_piece_cache___
+#define ___libcow_piece_cache___
+
+#include <boost/thread.hpp>
+#include <boost/utility.hpp>
+
+#include <list>
+#include <map>
+#include <vector>
+
+namespace libcow 
+{
+   /**
+    * A bounded, thread safe LRU cache of piece data keyed by piece index.
+    * download_control keeps the pieces that download_devices hand to it
+    * here, so that they can be read before libtorrent has written them
+    * to disk.
+    */
+    class piece_cache : public boost::noncopyable
+    {
+    public:
+       /**
+        * Creates a new piece_cache.
+        * @param max_pieces The maximum number of pieces to keep. A cache
+        * with room for 0 pieces doesn't keep anything.
+        */
+        piece_cache(size_t max_pieces);
+
+       /**
+        * Changes the maximum number of pieces to keep. Least recently
+        * used pieces are evicted if the cache holds too many pieces.
+        * @param max_pieces The maximum number of pieces to keep.
+        */
+        void set_max_pieces(size_t max_pieces);
+
+       /**
+        * Adds a copy of the piece data to the cache, replacing any data
+        * that is already cached for the piece.
+        * @param piece_index The index of the piece.
+        * @param data The piece data.
+        * @param size The size of the piece data in bytes.
+        */
+        void insert(int piece_index, const char* data, size_t size);
+
+       /**
+        * Checks whether or not the piece is cached.
+        * @param piece_index The index of the piece.
+        * @return True if the piece is cached, otherwise false.
+        */
+        bool contains(int piece_index);
+
+       /**
+        * Copies data from a cached piece.
+        * @param piece_index The index of the piece.
+        * @param piece_offset The byte offset within the piece to copy from.
+        * @param dest The memory to copy to.
+        * @param length The number of bytes to copy.
+        * @return True if the piece was cached and the data was copied, 
+        * otherwise false.
+        */
+        bool read(int piece_index, size_t piece_offset, char* dest, size_t length);
+
+       /**
+        * Removes a piece from the cache.
+        * @param piece_index The index of the piece.
+        */
+        void erase(int piece_index);
+
+    private:
+        typedef std::pair<int, std::vector<char> > entry;
+        typedef std::list<entry> entry_list;
+
+        void evict();
+
+        boost::mutex mutex_;
+
+        size_t max_pieces_;
+
+        // most recently used pieces first
+        entry_list entries_;
+        std::map<int, entry_list::iterator> index_;
+    };
+}
+
+#endif // ___libcow_piece_cache___
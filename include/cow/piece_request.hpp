@@ -29,6 +29,8 @@ or implied, of CowboyCoders.
 #ifndef ___libcow_piece_request___
 #define ___libcow_piece_request___
 
+#include <vector>
+
 namespace libcow {
 
     /**
@@ -67,5 +69,16 @@ namespace libcow {
         size_t count;
 
     };
+
+    /**
+     * Merges requests for the same or consecutive pieces into ranged
+     * requests, so that a device can fetch each run with one sequential
+     * transfer. The runs are sorted by index and every piece is requested
+     * once. The piece size is taken from the first request.
+     * @param reqs The requests to merge.
+     * @param ranged The vector to append the ranged requests to.
+     */
+    void LIBCOW_EXPORT coalesce_piece_requests(const std::vector<piece_request>& reqs,
+                                               std::vector<piece_request>& ranged);
 }
 #endif // ___libcow_piece_request___
@@ -0,0 +1,190 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL COWBOYCODERS OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of CowboyCoders.
+*/
+#ifndef ___libcow_piece_state_table___
+#define ___libcow_piece_state_table___
+
+#include <libtorrent/bitfield.hpp>
+
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/utility.hpp>
+
+namespace libcow 
+{
+   /**
+    * The state of every piece of a torrent, packed into one atomic byte per
+    * piece: whether the piece is available, whether it has been requested
+    * from a random access device, whether a device has already added it,
+    * and which source it was added by.
+    *
+    * Any thread can read the table without locking or posting to a
+    * dispatcher, and state() returns all three fields of a piece from a
+    * single load. The fields are written from different threads, so each
+    * write only touches its own bits, atomically.
+    *
+    * This does not replace piece_availability, which is still used for
+    * range queries over the available pieces.
+    */
+    class piece_state_table : public boost::noncopyable
+    {
+    public:
+       /**
+        * The bit of a piece state that is set when the piece is available.
+        */
+        static const unsigned char have_bit = 0x80;
+
+       /**
+        * The bit of a piece state that is set when the piece has been
+        * requested from a random access device.
+        */
+        static const unsigned char requested_bit = 0x40;
+
+       /**
+        * The bit of a piece state that is set when a device has added the
+        * piece, before it is available.
+        */
+        static const unsigned char added_bit = 0x20;
+
+       /**
+        * The bits of a piece state that hold its origin.
+        */
+        static const unsigned char origin_mask = 0x1f;
+
+       /**
+        * The largest source id that can be stored as an origin.
+        */
+        static const int max_origin = origin_mask;
+
+       /**
+        * Creates a new piece_state_table where no pieces are available,
+        * requested or have an origin.
+        * @param num_pieces The number of pieces in the torrent.
+        */
+        piece_state_table(int num_pieces);
+
+       /**
+        * Replaces the availability of all pieces.
+        * @param pieces The bitfield to copy, e.g. from torrent_status.
+        */
+        void reset_have(const libtorrent::bitfield& pieces);
+
+       /**
+        * Marks all pieces as available.
+        */
+        void set_all_have();
+
+       /**
+        * Sets whether or not a piece is available.
+        * @param piece_index The index of the piece.
+        * @param have True if the piece is available, otherwise false.
+        */
+        void set_have(int piece_index, bool have);
+
+       /**
+        * Sets whether or not a piece has been requested from a random
+        * access device.
+        * @param piece_index The index of the piece.
+        * @param requested True if the piece has been requested, otherwise false.
+        */
+        void set_requested(int piece_index, bool requested);
+
+       /**
+        * Marks a piece as added by a device. When several devices deliver
+        * the same piece at the same time, only one of them gets to add it.
+        * @param piece_index The index of the piece.
+        * @return True if the piece wasn't marked before, otherwise false.
+        */
+        bool mark_added(int piece_index);
+
+       /**
+        * Clears the added mark of a piece, e.g. when its hash check failed
+        * and it has to be downloaded again.
+        * @param piece_index The index of the piece.
+        */
+        void clear_added(int piece_index);
+
+       /**
+        * Sets the origin of a piece.
+        * @param piece_index The index of the piece.
+        * @param source The id of the source, or 0 for none.
+        * @return False if the piece index or the source id is out of range,
+        * otherwise true.
+        */
+        bool set_origin(int piece_index, int source);
+
+       /**
+        * @param piece_index The index of the piece.
+        * @return All fields of the piece state, or 0 if the index is out
+        * of range.
+        */
+        unsigned char state(int piece_index) const;
+
+       /**
+        * @param piece_index The index of the piece.
+        * @return True if the piece is available, otherwise false.
+        */
+        bool has_piece(int piece_index) const
+        {
+            return (state(piece_index) & have_bit) != 0;
+        }
+
+       /**
+        * @param piece_index The index of the piece.
+        * @return True if the piece has been requested, otherwise false.
+        */
+        bool is_requested(int piece_index) const
+        {
+            return (state(piece_index) & requested_bit) != 0;
+        }
+
+       /**
+        * @param piece_index The index of the piece.
+        * @return The id of the source the piece was added by, or 0.
+        */
+        int origin(int piece_index) const
+        {
+            return state(piece_index) & origin_mask;
+        }
+
+       /**
+        * @return The number of pieces in the torrent.
+        */
+        int num_pieces() const
+        {
+            return num_pieces_;
+        }
+
+    private:
+        void set_bit(int piece_index, unsigned char bit, bool value);
+
+        int num_pieces_;
+        boost::scoped_array<boost::atomic<unsigned char> > states_;
+    };
+}
+
+#endif // ___libcow_piece_state_table___
@@ -0,0 +1,117 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL COWBOYCODERS OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of CowboyCoders.
+*/
+
+#ifndef ___libcow_rate_estimator___
+#define ___libcow_rate_estimator___
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <cstddef>
+
+namespace libcow 
+{
+   /**
+    * Estimates a transfer rate in bytes per second. The bytes are counted
+    * over sampling intervals of at least a given length, and the rate is an
+    * exponentially weighted moving average (EWMA) of the interval rates.
+    * An idle source decays towards 0 as empty intervals are sampled.
+    * This class is not thread safe.
+    */
+    class rate_estimator
+    {
+    public:
+       /**
+        * Creates a new rate_estimator without any estimate.
+        * @param alpha The weight of the latest interval, between 0 and 1.
+        * @param interval The shortest sampling interval in seconds.
+        */
+        rate_estimator(double alpha = 0.3, double interval = 1.0)
+            : alpha_(alpha),
+              interval_(interval),
+              rate_(0.0),
+              bytes_(0),
+              has_rate_(false) {} // empty
+
+       /**
+        * Counts bytes that were transferred.
+        * @param bytes The number of bytes.
+        * @param now The current time.
+        */
+        void add(size_t bytes, const boost::posix_time::ptime& now)
+        {
+            update(now);
+            bytes_ += bytes;
+        }
+
+       /**
+        * Returns the estimated rate.
+        * @param now The current time.
+        * @return The rate in bytes per second, or 0 if there is no estimate yet.
+        */
+        double rate(const boost::posix_time::ptime& now)
+        {
+            update(now);
+            return rate_;
+        }
+
+       /**
+        * @return True if at least one sampling interval has completed.
+        */
+        bool has_rate() const
+        {
+            return has_rate_;
+        }
+
+    private:
+        void update(const boost::posix_time::ptime& now)
+        {
+            if(start_.is_not_a_date_time()) {
+                start_ = now;
+                return;
+            }
+            double elapsed = (now - start_).total_microseconds() / 1000000.0;
+            if(elapsed < interval_) {
+                return;
+            }
+            double sample = bytes_ / elapsed;
+            rate_ = has_rate_ ? alpha_ * sample + (1.0 - alpha_) * rate_ : sample;
+            has_rate_ = true;
+            bytes_ = 0;
+            start_ = now;
+        }
+
+        double alpha_;
+        double interval_;
+        double rate_;
+        size_t bytes_;
+        bool has_rate_;
+        boost::posix_time::ptime start_;
+    };
+}
+
+#endif // ___libcow_rate_estimator___
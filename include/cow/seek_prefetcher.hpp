@@ -0,0 +1,100 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification, are
+permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice, this list of
+      conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice, this list
+      of conditions and the following disclaimer in the documentation and/or other materials
+      provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL COWBOYCODERS OR
+CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those of the
+authors and should not be interpreted as representing official policies, either expressed
+or implied, of CowboyCoders.
+*/
+
+#ifndef ___libcow_seek_prefetcher___
+#define ___libcow_seek_prefetcher___
+
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace libcow 
+{
+   /**
+    * Learns where the seeks of a program tend to land, e.g. chapter starts,
+    * the end of an intro or a favourite resume point, so that the pieces
+    * there can be downloaded before the next seek. The targets are counted
+    * per piece, and older seeks weigh less than recent ones. The history can
+    * be saved to a file, so that it is kept between sessions.
+    * This class is not thread safe.
+    */
+    class seek_prefetcher
+    {
+    public:
+       /**
+        * Creates a new seek_prefetcher without any history.
+        * @param piece_size The size of the pieces that seeks are counted by.
+        */
+        seek_prefetcher(size_t piece_size);
+
+       /**
+        * Records a seek.
+        * @param offset The byte offset that the seek landed on.
+        */
+        void record_seek(size_t offset);
+
+       /**
+        * Finds the most likely seek targets. Only targets that have been
+        * seeked to more than once, taking the decay into account, are
+        * considered.
+        * @param max_targets The maximum number of targets to return.
+        * @param targets Receives the byte offsets of the targets, most likely first.
+        */
+        void likely_targets(size_t max_targets, std::vector<size_t>& targets) const;
+
+       /**
+        * Replaces the history with one that has been saved.
+        * @param path The file to read.
+        * @return True if the file could be read, otherwise false.
+        */
+        bool load(const std::string& path);
+
+       /**
+        * Saves the history.
+        * @param path The file to write.
+        * @return True if the file could be written, otherwise false.
+        */
+        bool save(const std::string& path) const;
+
+       /**
+        * @return True if no seeks have been recorded or loaded, otherwise false.
+        */
+        bool empty() const
+        {
+            return weights_.empty();
+        }
+
+    private:
+        size_t piece_size_;
+        // the weight of each seek target, by piece index
+        std::map<size_t, double> weights_;
+    };
+}
+
+#endif // ___libcow_seek_prefetcher___
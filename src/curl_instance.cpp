@@ -95,6 +95,10 @@ curl_instance::~curl_instance()
 
 int curl_instance::progress_callback(double dltotal,double dlnow,double ultotal,double ulnow)
 {
+    // a non-zero return value makes curl abort the transfer
+    if(abort_function_ && abort_function_()) {
+        return 1;
+    }
     return 0;
 }
 
@@ -163,7 +167,7 @@ void curl_instance::set_headers(const std::vector<std::string>& headers)
     }
 }
 
-void curl_instance::execute_curl_request()
+void curl_instance::execute_curl_request(long expected_http_code)
 {
     BOOST_LOG_TRIVIAL(debug) << "curl_instance: execute_curl_request called";
     CURLcode res = curl_easy_perform(curl);
@@ -180,7 +184,7 @@ void curl_instance::execute_curl_request()
 
     long http_code = get_http_code();
     
-    if(http_code != 200) {
+    if(http_code != expected_http_code) {
         std::stringstream msg;
         msg << "Download failed from URL '" << url_ << "'. Error code: " << http_code;
         throw libcow::exception(msg.str());
@@ -208,6 +212,31 @@ utils::buffer curl_instance::perform_bounded_request(size_t timeout,
     return utils::buffer(allocated_buffer_,allocated_buffer_size_);
 }
 
+utils::buffer curl_instance::perform_range_request(size_t timeout, size_t offset, size_t length)
+{
+    set_timeout(timeout);
+
+    std::stringstream range;
+    range << offset << "-" << offset + length - 1;
+    std::string range_str = range.str();
+    CURLcode res = curl_easy_setopt(curl, CURLOPT_RANGE, range_str.c_str());
+    check_curl_code(res);
+
+    allocated_buffer_size_ = length;
+    allocated_buffer_ = new char[allocated_buffer_size_];
+
+    res = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_instance::invoke_allocated_write); 
+    check_curl_code(res);
+    
+    res = curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
+    check_curl_code(res);
+
+    // a 200 would mean that the server ignored the range and sent the whole file
+    execute_curl_request(206);
+
+    return utils::buffer(allocated_buffer_, allocated_buffer_size_);
+}
+
 std::stringstream& curl_instance::perform_unbounded_request(size_t timeout, 
                                                             const std::vector<std::string>& headers)
 {
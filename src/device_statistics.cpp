@@ -0,0 +1,95 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include "cow/libcow_def.hpp"
+#include "cow/device_statistics.hpp"
+
+#include <algorithm>
+
+using namespace libcow;
+
+// the weight of the latest sample in the averages
+static const double alpha = 0.25;
+// the assumed performance of a device that hasn't delivered anything yet
+static const double initial_latency = 0.2;
+static const double initial_throughput = 2 * 1024 * 1024;
+// a device never counts as slower than this, even if it fails most requests
+static const double min_success_rate = 0.05;
+
+device_statistics::device_statistics()
+    : latency_(initial_latency),
+      throughput_(initial_throughput),
+      error_rate_(0.0),
+      queued_bytes_(0),
+      has_latency_(false),
+      has_throughput_(false)
+{
+
+}
+
+void device_statistics::request_sent(size_t bytes)
+{
+    queued_bytes_ += bytes;
+}
+
+void device_statistics::bytes_delivered(size_t bytes)
+{
+    queued_bytes_ -= std::min(bytes, queued_bytes_);
+}
+
+void device_statistics::add_latency(double seconds)
+{
+    latency_ = has_latency_ ? alpha * seconds + (1.0 - alpha) * latency_ : seconds;
+    has_latency_ = true;
+}
+
+void device_statistics::add_throughput(double bytes_per_second)
+{
+    throughput_ = has_throughput_ ? alpha * bytes_per_second + (1.0 - alpha) * throughput_ 
+                                  : bytes_per_second;
+    has_throughput_ = true;
+}
+
+void device_statistics::request_succeeded()
+{
+    error_rate_ = (1.0 - alpha) * error_rate_;
+}
+
+void device_statistics::request_failed(size_t bytes)
+{
+    error_rate_ = alpha + (1.0 - alpha) * error_rate_;
+    bytes_delivered(bytes);
+}
+
+double device_statistics::expected_completion(size_t bytes) const
+{
+    double transfer_time = (queued_bytes_ + bytes) / std::max(throughput_, 1.0);
+    // a failed request has to be made again, somewhere
+    return (latency_ + transfer_time) / std::max(1.0 - error_rate_, min_success_rate);
+}
@@ -31,13 +31,35 @@ either expressed or implied, of CowboyCoders.
 
 #include <boost/log/trivial.hpp>
 #include <iostream>
+#include <algorithm>
 
 using namespace libcow;
 
+const int dispatcher::timer_resolution;
+
+// the number of slots in the timer wheel, one revolution is 2.56 s
+static const size_t wheel_size = 256;
+
+// rounds a delay in ms up to whole ticks
+static boost::uint64_t to_ticks(int ms)
+{
+    if(ms <= 0) {
+        return 0;
+    }
+    return (ms + dispatcher::timer_resolution - 1) / dispatcher::timer_resolution;
+}
+
 dispatcher::dispatcher(int timer_delay)
-    : work(io_service),
+    : timer_delay_(timer_delay),
+      wheel_(wheel_size),
+      next_timer_id_(1),
+      last_tick_(0),
+      ticking_(false),
+      armed_tick_(0),
+      start_time_(boost::posix_time::microsec_clock::universal_time()),
+      work(io_service),
       thread(boost::bind(&boost::asio::io_service::run, &io_service)),
-      deadline_timer(io_service, boost::posix_time::milliseconds(timer_delay))
+      deadline_timer(io_service)
 {
 
 }
@@ -48,3 +70,186 @@ dispatcher::~dispatcher()
     io_service.stop();
     thread.join();
 }
+
+dispatcher::timer_id dispatcher::post_delayed(const boost::function<void()>& handler)
+{
+    return add_timer(handler, timer_delay_, 0);
+}
+
+dispatcher::timer_id dispatcher::post_delayed(const boost::function<void()>& handler, int delay)
+{
+    return add_timer(handler, delay, 0);
+}
+
+dispatcher::timer_id dispatcher::post_periodic(const boost::function<void()>& handler, int interval)
+{
+    return add_timer(handler, interval, interval);
+}
+
+bool dispatcher::cancel(timer_id id)
+{
+    boost::mutex::scoped_lock lock(timer_mutex_);
+    return timers_.erase(id) > 0;
+}
+
+dispatcher::timer_id dispatcher::add_timer(const boost::function<void()>& handler, 
+                                           int delay, 
+                                           int interval)
+{
+    boost::mutex::scoped_lock lock(timer_mutex_);
+
+    boost::uint64_t now = current_tick();
+    if(!ticking_) {
+        // the wheel isn't advanced while there are no timers
+        last_tick_ = std::max(last_tick_, now);
+    }
+
+    timer t;
+    t.handler = handler;
+    // current_tick() rounds down, so we may already be most of a tick past
+    // now. The extra tick makes sure the job never runs before its delay.
+    t.expiry = std::max(last_tick_, now) + to_ticks(delay) + 1;
+    t.interval = interval > 0 ? to_ticks(interval) : 0;
+
+    timer_id id = next_timer_id_++;
+    timers_[id] = t;
+    wheel_[t.expiry % wheel_size].push_back(id);
+
+    if(!ticking_) {
+        ticking_ = true;
+        io_service.post(boost::bind(&dispatcher::schedule_tick, this));
+    } else if(t.expiry < armed_tick_) {
+        // the wheel is asleep until a later tick
+        io_service.post(boost::bind(&dispatcher::schedule_tick, this));
+    }
+    return id;
+}
+
+boost::uint64_t dispatcher::current_tick() const
+{
+    boost::posix_time::time_duration elapsed = 
+        boost::posix_time::microsec_clock::universal_time() - start_time_;
+    if(elapsed.is_negative()) {
+        return 0;
+    }
+    return elapsed.total_milliseconds() / timer_resolution;
+}
+
+void dispatcher::schedule_tick()
+{
+    boost::uint64_t next_tick;
+    {
+        boost::mutex::scoped_lock lock(timer_mutex_);
+        next_tick = next_expiry();
+        armed_tick_ = next_tick;
+    }
+    // replaces the wait that is pending, if any
+    deadline_timer.expires_at(start_time_ + 
+        boost::posix_time::milliseconds(next_tick * timer_resolution));
+    deadline_timer.async_wait(boost::bind(&dispatcher::handle_tick, this, 
+                                          boost::asio::placeholders::error));
+}
+
+boost::uint64_t dispatcher::next_expiry()
+{
+    /* Rather than waking up every tick, the wheel sleeps until the first
+     * slot with a timer that is due in this revolution. The slots in
+     * between are still visited by handle_tick when it wakes up.
+     */
+    for(boost::uint64_t tick = last_tick_ + 1; tick <= last_tick_ + wheel_size; ++tick) {
+        const std::vector<timer_id>& ids = wheel_[tick % wheel_size];
+        for(size_t i = 0; i < ids.size(); ++i) {
+            std::map<timer_id, timer>::const_iterator it = timers_.find(ids[i]);
+            if(it != timers_.end() && it->second.expiry <= tick) {
+                return tick;
+            }
+        }
+    }
+    return last_tick_ + wheel_size;
+}
+
+void dispatcher::handle_tick(const boost::system::error_code& error)
+{
+    if(error) {
+        return;
+    }
+
+    boost::uint64_t now = current_tick();
+    std::vector<timer_id> expired;
+    {
+        boost::mutex::scoped_lock lock(timer_mutex_);
+        if(now > last_tick_) {
+            // when the thread has been busy for a whole revolution, each slot is visited once
+            boost::uint64_t first_tick = last_tick_ + 1;
+            if(now - last_tick_ > wheel_size) {
+                first_tick = now + 1 - wheel_size;
+            }
+            for(boost::uint64_t tick = first_tick; tick <= now; ++tick) {
+                collect_expired(tick % wheel_size, now, expired);
+            }
+            last_tick_ = now;
+        }
+    }
+
+    std::vector<timer_id>::iterator it;
+    for(it = expired.begin(); it != expired.end(); ++it) {
+        run_timer(*it, now);
+    }
+
+    {
+        boost::mutex::scoped_lock lock(timer_mutex_);
+        if(timers_.empty()) {
+            ticking_ = false;
+            return;
+        }
+    }
+    schedule_tick();
+}
+
+void dispatcher::collect_expired(size_t slot, 
+                                 boost::uint64_t tick, 
+                                 std::vector<timer_id>& expired)
+{
+    std::vector<timer_id>& ids = wheel_[slot];
+    size_t num_kept = 0;
+    for(size_t i = 0; i < ids.size(); ++i) {
+        std::map<timer_id, timer>::iterator it = timers_.find(ids[i]);
+        if(it == timers_.end()) {
+            // cancelled
+            continue;
+        }
+        if(it->second.expiry <= tick) {
+            expired.push_back(ids[i]);
+        } else {
+            // due on a later revolution
+            ids[num_kept++] = ids[i];
+        }
+    }
+    ids.resize(num_kept);
+}
+
+void dispatcher::run_timer(timer_id id, boost::uint64_t tick)
+{
+    boost::function<void()> handler;
+    {
+        boost::mutex::scoped_lock lock(timer_mutex_);
+        std::map<timer_id, timer>::iterator it = timers_.find(id);
+        if(it == timers_.end()) {
+            // cancelled by a job that ran before this one
+            return;
+        }
+        timer& t = it->second;
+        handler = t.handler;
+        if(t.interval > 0) {
+            // periodic jobs keep their phase, but don't run twice to catch up
+            t.expiry += t.interval;
+            if(t.expiry <= tick) {
+                t.expiry = tick + t.interval;
+            }
+            wheel_[t.expiry % wheel_size].push_back(id);
+        } else {
+            timers_.erase(it);
+        }
+    }
+    handler();
+}
@@ -33,10 +33,11 @@ either expressed or implied, of CowboyCoders.
 #include "cow/piece_request.hpp"
 #include "cow/progress_info.hpp"
 #include "cow/download_device.hpp"
-#include "cow/system.hpp"
 #include "cow/dispatcher.hpp"
 
 #include <boost/log/trivial.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/exceptions.hpp>
 #include <libtorrent/peer_info.hpp>
 
 #include <iostream>
@@ -47,25 +48,35 @@ either expressed or implied, of CowboyCoders.
 
 using namespace libcow;
 
+static const size_t default_piece_cache_size = 16;
+
 download_control::download_control(const libtorrent::torrent_handle& handle, 
                                    int critical_window_length,
                                    int critical_window_timeout,
                                    int id,
                                    std::string download_directory)
     : handle_(handle),
+      availability_(handle_.get_torrent_info().num_pieces()),
+      piece_states_(handle_.get_torrent_info().num_pieces()),
+      cache_(default_piece_cache_size),
+      piece_size_(handle_.get_torrent_info().piece_length()),
+      file_size_(handle_.get_torrent_info().file_at(0).size),
+      file_open_(false),
       id_(id),
       download_dir_(download_directory)
 
 {
-    srand (time(NULL));
-
-    event_handler_ = new download_control_event_handler(handle_);
-    worker_ = new download_control_worker(handle_, critical_window_length, critical_window_timeout);
+    event_handler_ = new download_control_event_handler(handle_, availability_, piece_states_);
+    worker_ = new download_control_worker(handle_, availability_, piece_states_, critical_window_length, critical_window_timeout);
+    worker_->set_readahead_handler(boost::bind(&download_control::advise_file, this, _1, _2, _3));
+    reader_ = new dispatcher(0);
 }
 
 download_control::~download_control()
 {
+    // the devices of the worker add pieces, which posts reads to reader_
     delete worker_;
+    delete reader_;
     delete event_handler_;
 }
 
@@ -81,17 +92,24 @@ int download_control::piece_length()
 //FIXME: queue add_piece calls if libtorrent is still checking hash
 void download_control::add_pieces(int id, const std::vector<piece_data>& pieces)
 {
-    if(handle_.is_valid() && !handle_.is_seed()) {
+    if(handle_.is_valid()) {
+        /* When seeding, pieces are still counted, so that the worker keeps
+         * measuring the devices, but they aren't added.
+         */
+        bool complete = availability_.is_complete();
         const libtorrent::torrent_info& info = handle_.get_torrent_info();
         std::vector<piece_data>::const_iterator iter;
+        std::vector<int> received;
+        size_t bytes_received = 0;
+        int num_rejected = 0;
 
-        const libtorrent::torrent_status& status = handle_.status();
         for(iter = pieces.begin(); iter != pieces.end(); ++iter) 
         {
             if(iter->index >= info.num_pieces()) {
                 BOOST_LOG_TRIVIAL(error) << "download_control::add_pieces: "
                     << "trying to add piece with index " << iter->index
                     << "which is out of bounds";
+                ++num_rejected;
                 continue;
             }
             if((int)iter->data.size() < info.piece_size(iter->index)) {
@@ -99,11 +117,16 @@ void download_control::add_pieces(int id, const std::vector<piece_data>& pieces)
                     << "trying to add piece with index " << iter->index
                     << " and size " << iter->data.size() << ", but expected size is "
                     << info.piece_size(iter->index);
+                ++num_rejected;
                 continue;
             }
+            received.push_back(iter->index);
+            bytes_received += iter->data.size();
             
-            const libtorrent::bitfield& pieces = status.pieces;
-            if(pieces[iter->index]) {
+            // a hedged piece may arrive from two devices at once, the second copy is dropped
+            if(complete || availability_.has_piece(iter->index) || 
+               !piece_states_.mark_added(iter->index)) 
+            {
                 continue;
             }
             
@@ -112,11 +135,17 @@ void download_control::add_pieces(int id, const std::vector<piece_data>& pieces)
             BOOST_LOG_TRIVIAL(debug) << "download_control::add_piece: adding piece with index "
                                      << iter->index;
             if(handle_.is_valid()) {
+                // readers don't have to wait for libtorrent to write the piece to disk
+                cache_.insert(iter->index, iter->data.data(), info.piece_size(iter->index));
                 handle_.add_piece(iter->index, iter->data.data());
+                wake_read_waiters(iter->index);
             } else {
                 BOOST_LOG_TRIVIAL(debug) << "add_piece: invalid torrent handle";
             }
         }
+
+        // the worker measures the devices to size the critical window and pick devices
+        worker_->report_pieces_received(id, received, bytes_received, num_rejected);
     }
 }
 
@@ -129,47 +158,27 @@ bool download_control::has_data(size_t offset, size_t length)
 {
     assert(length > 0);
 	
-    const libtorrent::torrent_info& info = handle_.get_torrent_info();
-	int piece_size = info.piece_length();
+    // doesn't go through the torrent_handle, readers call this a lot
+    int num_pieces = availability_.num_pieces();
     
-	size_t piece_start = offset / piece_size;
-	size_t piece_end = (offset + length - 1) / piece_size;
-    if((int) piece_end >= info.num_pieces()) {
-        piece_end = info.num_pieces() - 1;
+	size_t piece_start = offset / piece_size_;
+	size_t piece_end = (offset + length - 1) / piece_size_;
+    if((int) piece_end >= num_pieces) {
+        piece_end = num_pieces - 1;
     }
 
-    if ((int)piece_start >= info.num_pieces()) {
+    if ((int)piece_start >= num_pieces) {
         BOOST_LOG_TRIVIAL(warning) << "piece out of range";
         BOOST_LOG_TRIVIAL(warning) << "piece_start: " << piece_start << " piece_end: " << piece_end;
-        BOOST_LOG_TRIVIAL(warning) << "num_pieces: " << info.num_pieces();
-        BOOST_LOG_TRIVIAL(warning) << "piece_size: " << piece_size;
+        BOOST_LOG_TRIVIAL(warning) << "num_pieces: " << num_pieces;
+        BOOST_LOG_TRIVIAL(warning) << "piece_size: " << piece_size_;
         BOOST_LOG_TRIVIAL(warning) << "length: " << length;
         BOOST_LOG_TRIVIAL(warning) << "offset: " << offset;
         throw std::out_of_range("has_data: piece index out of range");
         //return false;
 	}
 
-    libtorrent::torrent_status status = handle_.status();
-    
-    if(status.state == libtorrent::torrent_status::seeding)
-    {
-        return true;
-    }
-	else if (status.state == libtorrent::torrent_status::downloading ||
-             status.state == libtorrent::torrent_status::finished)
-    {
-	    const libtorrent::bitfield& pieces = status.pieces;
-		for (size_t i = piece_start; i <= piece_end ; ++i) {
-			if (!pieces[i]) {
-				return false;
-			}
-		}
-        return true;
-	}
-    else
-    {
-        return false;
-    }
+    return availability_.has_pieces(piece_start, piece_end);
 }
 
 size_t download_control::bytes_available(size_t offset) const
@@ -183,20 +192,12 @@ size_t download_control::bytes_available(size_t offset) const
         throw std::out_of_range("bytes_available: offset out of range");
 	}
 
-    libtorrent::torrent_status status = handle_.status();
-	if (status.state != libtorrent::torrent_status::seeding) {
-	    const libtorrent::bitfield& pieces = status.pieces;
-
-        if (!pieces[piece_start]) {
-            return 0;
-        }
-
-		for (int i = piece_start + 1; i < info.num_pieces(); ++i) {
-			if (!pieces[i]) {
-				return i * piece_size - offset;
-			}
-		}
-	}
+    int missing_piece = availability_.next_missing_piece(piece_start);
+    if (missing_piece == (int)piece_start) {
+        return 0;
+    } else if (missing_piece < info.num_pieces()) {
+        return static_cast<size_t>(missing_piece) * piece_size - offset;
+    }
 
     return info.file_at(0).size - offset;
 }
@@ -213,44 +214,389 @@ std::string download_control::filename() const
     return absolute_path;
 }
 
+bool download_control::is_readable(size_t offset, size_t length)
+{
+    if(has_data(offset, length)) {
+        return true;
+    }
+
+    // the range is readable if every piece is either on disk or cached
+    int piece_start = offset / piece_size_;
+    int piece_end = std::min<int>((offset + length - 1) / piece_size_, availability_.num_pieces() - 1);
+
+    for(int i = piece_start; i <= piece_end; ++i) {
+        if(!availability_.has_piece(i) && !cache_.contains(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool download_control::wait_for_data(size_t offset, size_t length, int timeout, data_predicate ready)
+{
+    // there are no pieces to wait for, and offset + length - 1 would wrap
+    if(length == 0) {
+        return true;
+    }
+    if((this->*ready)(offset, length)) {
+        return true;
+    }
+
+    read_waiter waiter(offset / piece_size_, (offset + length - 1) / piece_size_);
+
+    boost::system_time deadline = 
+        boost::get_system_time() + boost::posix_time::milliseconds(timeout);
+
+    /* The waiter is registered before has_data is checked again, and
+     * wake_read_waiters takes the same lock, so a piece that finishes
+     * in between can't be missed.
+     */
+    boost::unique_lock<boost::mutex> lock(waiter_mutex_);
+    read_waiters_.push_back(&waiter);
+
+    bool downloaded = true;
+    while(!(this->*ready)(offset, length)) {
+        if(timeout < 0) {
+            waiter.cond.wait(lock);
+        } else if(!waiter.cond.timed_wait(lock, deadline)) {
+            downloaded = (this->*ready)(offset, length);
+            break;
+        }
+    }
+
+    read_waiters_.remove(&waiter);
+    return downloaded;
+}
+
+void download_control::wake_read_waiters(int piece_index)
+{
+    boost::lock_guard<boost::mutex> lock(waiter_mutex_);
+
+    std::list<read_waiter*>::iterator it;
+    for(it = read_waiters_.begin(); it != read_waiters_.end(); ++it) {
+        read_waiter* waiter = *it;
+        if(piece_index < 0 ||
+           (waiter->first_piece <= piece_index && piece_index <= waiter->last_piece)) 
+        {
+            waiter->cond.notify_one();
+        }
+    }
+
+    std::list<pending_read>::iterator read_it = pending_reads_.begin();
+    while(read_it != pending_reads_.end()) {
+        if((piece_index < 0 ||
+            (read_it->first_piece <= piece_index && piece_index <= read_it->last_piece)) &&
+           is_readable(read_it->offset, read_it->buffer.size()))
+        {
+            reader_->post(boost::bind(&download_control::handle_async_read, this,
+                                      read_it->offset, read_it->buffer, read_it->handler));
+            read_it = pending_reads_.erase(read_it);
+        } else {
+            ++read_it;
+        }
+    }
+}
+
+void download_control::async_read(size_t offset, libcow::utils::buffer buffer, read_handler handler)
+{
+    if(buffer.size() == 0) {
+        reader_->post(boost::bind(handler, 0));
+        return;
+    }
+
+    // see wait_for_data for why the data is checked with the lock held
+    boost::lock_guard<boost::mutex> lock(waiter_mutex_);
+    if(is_readable(offset, buffer.size())) {
+        reader_->post(boost::bind(&download_control::handle_async_read, this,
+                                  offset, buffer, handler));
+    } else {
+        pending_reads_.push_back(pending_read(offset / piece_size_, 
+                                              (offset + buffer.size() - 1) / piece_size_,
+                                              offset, buffer, handler));
+    }
+}
+
+boost::unique_future<size_t> download_control::async_read(size_t offset, libcow::utils::buffer buffer)
+{
+    boost::shared_ptr<boost::promise<size_t> > promise(new boost::promise<size_t>());
+    async_read(offset, buffer, boost::bind(&download_control::set_read_result, promise, _1));
+    return promise->get_future();
+}
+
+void download_control::handle_async_read(size_t offset, libcow::utils::buffer buffer, read_handler handler)
+{
+    // the data was readable when this was posted, but a cached piece may
+    // have been lost since, so don't wait for it on the reader thread
+    size_t bytes = read_data(offset, buffer, 0);
+    size_t expected = offset < file_size_ ? std::min(buffer.size(), file_size_ - offset) : 0;
+    if(bytes < expected) {
+        {
+            // queued again with the lock held, like in async_read
+            boost::lock_guard<boost::mutex> lock(waiter_mutex_);
+            if(!is_readable(offset, buffer.size())) {
+                pending_reads_.push_back(pending_read(offset / piece_size_, 
+                                                      (offset + buffer.size() - 1) / piece_size_,
+                                                      offset, buffer, handler));
+                return;
+            }
+        }
+        // the piece reached the disk in the meantime
+        bytes = read_data(offset, buffer, 0);
+    }
+    handler(bytes);
+}
+
+void download_control::set_read_result(boost::shared_ptr<boost::promise<size_t> > promise, size_t bytes)
+{
+    promise->set_value(bytes);
+}
+
 size_t download_control::read_data(size_t offset, libcow::utils::buffer& buffer)
 {
-	while(!has_data(offset, buffer.size())){
-        libcow::system::sleep(10);
+    return read_data(offset, buffer, -1);
+}
+
+size_t download_control::read_data(size_t offset, libcow::utils::buffer& buffer, int timeout)
+{
+    boost::system_time deadline = 
+        boost::get_system_time() + boost::posix_time::milliseconds(timeout);
+
+    size_t bytes_read = 0;
+    while(bytes_read < buffer.size()) {
+        size_t pos = offset + bytes_read;
+        size_t length = buffer.size() - bytes_read;
+        int time_left = timeout;
+        if(timeout >= 0) {
+            time_left = std::max<int>(0, static_cast<int>(
+                (deadline - boost::get_system_time()).total_milliseconds()));
+        }
+        if(!wait_for_data(pos, length, time_left, &download_control::is_readable)) {
+            break;
+        }
+
+        size_t bytes = read_bytes(pos, buffer.data() + bytes_read, length);
+        bytes_read += bytes;
+
+        /* A short read means the end of the file, a read error, or that a
+         * piece was evicted from the cache before it reached the disk. Only
+         * the last case is worth waiting for again.
+         */
+        if(bytes_read < buffer.size() && 
+           (offset + bytes_read >= file_size_ || 
+            (bytes == 0 && is_readable(offset + bytes_read, buffer.size() - bytes_read))))
+        {
+            break;
+        }
     }
 
-    if(!file_handle_.is_open()) {
-        std::string file_name = filename();
-#if 0
-        std::cout << "filename: " << filename << std::endl;
-        std::cout << "offset: " << offset << " bufsize: " << buffer.size() << std::endl;
-#endif
+    return bytes_read;
+}
+
+size_t download_control::read_data(const std::vector<read_range>& ranges)
+{
+    return read_data(ranges, -1);
+}
+
+size_t download_control::read_data(const std::vector<read_range>& ranges, int timeout)
+{
+    boost::system_time deadline = 
+        boost::get_system_time() + boost::posix_time::milliseconds(timeout);
+
+    /* The ranges are read in order, and the first one that comes back 
+     * short ends the read, so the total tells the caller how far it got.
+     */
+    size_t bytes_read = 0;
+    size_t i = 0;
+    while(i < ranges.size()) {
+        // find the ranges that directly follow this one in the file
+        size_t first = i;
+        size_t end = ranges[i].first + ranges[i].second.size();
+        for(++i; i < ranges.size() && ranges[i].first == end; ++i) {
+            end += ranges[i].second.size();
+        }
+
+        // data on disk can't go away, so it is safe to read in one go
+        size_t start = ranges[first].first;
+        if(i - first > 1 && start < end && end <= file_size_ && has_data(start, end - start)) {
+            std::vector<libcow::utils::buffer> buffers;
+            buffers.reserve(i - first);
+            for(size_t j = first; j < i; ++j) {
+                buffers.push_back(ranges[j].second);
+            }
+            size_t bytes = read_file(start, buffers);
+            bytes_read += bytes;
+            if(bytes < end - start) {
+                return bytes_read;
+            }
+            continue;
+        }
+
+        // anything else may have to wait, or be read again if it is evicted from the cache
+        for(size_t j = first; j < i; ++j) {
+            libcow::utils::buffer buffer = ranges[j].second;
+            size_t offset = ranges[j].first;
+            if(buffer.size() == 0) {
+                continue;
+            }
+            int time_left = timeout;
+            if(timeout >= 0) {
+                time_left = std::max<int>(0, static_cast<int>(
+                    (deadline - boost::get_system_time()).total_milliseconds()));
+            }
+            size_t bytes = read_data(offset, buffer, time_left);
+            bytes_read += bytes;
+            size_t expected = offset < file_size_ ? std::min(buffer.size(), file_size_ - offset) : 0;
+            if(bytes < expected || expected < buffer.size()) {
+                return bytes_read;
+            }
+        }
+    }
+
+    return bytes_read;
+}
+
+size_t download_control::read_bytes(size_t offset, char* dest, size_t length)
+{
+    if(offset >= file_size_) {
+        return 0;
+    }
+    size_t bytes_to_read = std::min(file_size_ - offset, length);
+    size_t piece_size = piece_size_;
+
+    size_t bytes_read = 0;
+    while(bytes_read < bytes_to_read) {
+        size_t pos = offset + bytes_read;
+        int piece = pos / piece_size;
+        size_t count = std::min(bytes_to_read - bytes_read, (piece + 1) * piece_size - pos);
+
+        // only pieces that aren't on disk yet have to go through the cache
+        if(!availability_.has_piece(piece)) {
+            if(!cache_.read(piece, pos - piece * piece_size, dest + bytes_read, count)) {
+                // evicted before it was written, the file doesn't have it either
+                break;
+            }
+            bytes_read += count;
+            continue;
+        }
 
-        file_handle_.open(file_name.c_str(), std::ios_base::in | std::ios_base::binary);
-        if(!file_handle_.is_open()) {
+        // read this piece and the following pieces that are on disk in one go
+        while(bytes_read + count < bytes_to_read && availability_.has_piece(piece + 1)) {
+            ++piece;
+            count = std::min(bytes_to_read - bytes_read, (piece + 1) * piece_size - pos);
+        }
+
+        size_t file_bytes = read_file(pos, dest + bytes_read, count);
+        bytes_read += file_bytes;
+        if(file_bytes < count) {
+            break;
+        }
+    }
+
+    return bytes_read;
+}
+
+bool download_control::open_file()
+{
+    if(file_open_.load(boost::memory_order_acquire)) {
+        return true;
+    }
+
+    boost::lock_guard<boost::mutex> lock(file_mutex_);
+    if(!file_.is_open()) {
+        std::string file_name = filename();
+        if(!file_.open(file_name)) {
             BOOST_LOG_TRIVIAL(warning) << "Could not open file: " << file_name;
-            return 0;
+            return false;
         }
-#if 0
-        std::cout << "READ DATA!" << std::endl;
-        std::cout << std::endl;
-#endif
+        file_open_.store(true, boost::memory_order_release);
     }
+    return true;
+}
 
-    file_handle_.seekg (0, std::ios::end);
-    size_t length = file_handle_.tellg();
-    file_handle_.seekg(offset, std::ios::beg);
+size_t download_control::read_file(size_t offset, char* dest, size_t length)
+{
+    if(!open_file()) {
+        return 0;
+    }
+    // positional reads, so concurrent readers don't disturb each other
+    return file_.read(offset, dest, length);
+}
 
-    size_t bytes_to_read = std::min(length-offset, buffer.size());
-    file_handle_.read(buffer.data(), bytes_to_read);
-    
-    return static_cast<size_t>(file_handle_.gcount());
+size_t download_control::read_file(size_t offset, const std::vector<libcow::utils::buffer>& buffers)
+{
+    if(!open_file()) {
+        return 0;
+    }
+    return file_.read(offset, buffers);
+}
+
+void download_control::advise_file(size_t offset, size_t length, file_reader::access_hint hint)
+{
+    if(open_file()) {
+        file_.advise(offset, length, hint);
+    }
+}
+        
+mapped_view download_control::map_data(size_t offset, size_t length)
+{
+    return map_data(offset, length, -1);
+}
+
+mapped_view download_control::map_data(size_t offset, size_t length, int timeout)
+{
+    if(length == 0) {
+        return mapped_view();
+    }
+
+    // the mapping can only see data that has been written to disk
+    if(!wait_for_data(offset, length, timeout, &download_control::has_data)) {
+        return mapped_view();
+    }
+
+    size_t size = file_size();
+    if(offset >= size) {
+        return mapped_view();
+    }
+    length = std::min(length, size - offset);
+
+    try {
+        {
+            boost::lock_guard<boost::mutex> lock(mapping_mutex_);
+            if(!file_mapping_) {
+                file_mapping_.reset(new boost::interprocess::file_mapping(
+                    filename().c_str(), boost::interprocess::read_only));
+            }
+        }
+
+        // the region doesn't depend on file_mapping_ once it has been created
+        boost::shared_ptr<boost::interprocess::mapped_region> region(
+            new boost::interprocess::mapped_region(
+                *file_mapping_, boost::interprocess::read_only, offset, length));
+        return mapped_view(region);
+    } catch(boost::interprocess::interprocess_exception& e) {
+        BOOST_LOG_TRIVIAL(warning) << "download_control::map_data: could not map "
+                                   << filename() << ": " << e.what();
+        return mapped_view();
+    }
 }
         
 bool download_control::get_current_state(std::vector<int>& state)
 {
     return event_handler_->get_current_state(state);
 }
+
+boost::uint64_t download_control::get_origin_snapshot(
+    std::vector<download_control_event_handler::origin_run>& runs)
+{
+    return event_handler_->get_origin_snapshot(runs);
+}
+
+bool download_control::get_origin_changes(boost::uint64_t since,
+                                          std::vector<std::pair<int,int> >& changes,
+                                          boost::uint64_t& version)
+{
+    return event_handler_->get_origin_changes(since, changes, version);
+}
         
 std::map<int,std::string> download_control::get_device_names()
 {
@@ -1,9 +1,12 @@
 #include "cow/libcow_def.hpp"
 #include "cow/download_control_event_handler.hpp"
-#include "cow/piece_request.hpp"
+#include "cow/cow.hpp"
+#include "cow/piece_availability.hpp"
+#include "cow/piece_state_table.hpp"
 
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
+#include <boost/log/trivial.hpp>
 
 #include <libtorrent/alert_types.hpp>
 #include <algorithm>
@@ -13,11 +16,22 @@ using namespace libcow;
 static int bittorrent_source_id = 2;
 static int disk_source_id = 1;
 
-download_control_event_handler::download_control_event_handler(libtorrent::torrent_handle& h)
+const int download_control_event_handler::default_flush_interval;
+const size_t download_control_event_handler::max_origin_changes;
+
+download_control_event_handler::download_control_event_handler(libtorrent::torrent_handle& h,
+                                                               const piece_availability& availability,
+                                                               piece_state_table& piece_states)
     : torrent_handle_(h),
+      availability_(availability),
+      piece_states_(piece_states),
+      flush_interval_(default_flush_interval),
+      flush_scheduled_(false),
+      flush_timer_(0),
+      origin_changes_base_(0),
       is_libtorrent_ready_(false)
 {
-    piece_origin_ = std::vector<int>(torrent_handle_.get_torrent_info().num_pieces(),0);
+    piece_waiters_.resize(piece_states_.num_pieces());
     callback_worker_ = new dispatcher(0);
     disp_ = new dispatcher(0);
 }
@@ -36,9 +50,27 @@ void download_control_event_handler::set_piece_src(int source, size_t piece_inde
 
 void download_control_event_handler::handle_set_piece_src(int source, size_t piece_index) 
 {
-    if(piece_index < piece_origin_.size())
-    {
-        piece_origin_[piece_index] = source;
+    if(piece_index < static_cast<size_t>(piece_states_.num_pieces())) {
+        set_piece_origin(static_cast<int>(piece_index), source);
+    }
+}
+
+void download_control_event_handler::set_piece_origin(int piece_index, int source)
+{
+    if(piece_states_.origin(piece_index) == source) {
+        return;
+    }
+
+    boost::mutex::scoped_lock lock(origin_mutex_);
+    if(!piece_states_.set_origin(piece_index, source)) {
+        BOOST_LOG_TRIVIAL(warning) << "download_control_event_handler: can't store source "
+                                   << source << " for piece " << piece_index;
+        return;
+    }
+    origin_changes_.push_back(std::make_pair(piece_index, source));
+    if(origin_changes_.size() > max_origin_changes) {
+        origin_changes_.pop_front();
+        ++origin_changes_base_;
     }
 }
 
@@ -51,7 +83,7 @@ void download_control_event_handler::handle_hash_failed(int piece_index)
 
 void download_control_event_handler::internal_handle_hash_failed(int piece_index)
 {
-    piece_origin_[piece_index] = 0;
+    set_piece_origin(piece_index, 0);
 }
 
 bool download_control_event_handler::get_current_state(std::vector<int>& state)
@@ -71,11 +103,44 @@ bool download_control_event_handler::get_current_state(std::vector<int>& state)
         
 bool download_control_event_handler::handle_get_current_state(std::vector<int>& state)
 {
-    state.resize(piece_origin_.size(),0);
+    state.resize(piece_states_.num_pieces(),0);
     for(size_t idx = 0; idx < state.size(); ++idx) {
     
-        state[idx] = piece_origin_[idx];
+        state[idx] = piece_states_.origin(static_cast<int>(idx));
+    }
+    return true;
+}
+
+boost::uint64_t download_control_event_handler::get_origin_snapshot(std::vector<origin_run>& runs)
+{
+    runs.clear();
+
+    boost::mutex::scoped_lock lock(origin_mutex_);
+    for(int idx = 0; idx < piece_states_.num_pieces(); ++idx) {
+        int source = piece_states_.origin(idx);
+        if(!runs.empty() && runs.back().source == source) {
+            ++runs.back().num_pieces;
+        } else {
+            runs.push_back(origin_run(idx, 1, source));
+        }
+    }
+    return origin_changes_base_ + origin_changes_.size();
+}
+
+bool download_control_event_handler::get_origin_changes(boost::uint64_t since,
+                                                        std::vector<std::pair<int,int> >& changes,
+                                                        boost::uint64_t& version)
+{
+    changes.clear();
+
+    boost::mutex::scoped_lock lock(origin_mutex_);
+    version = origin_changes_base_ + origin_changes_.size();
+    if(since < origin_changes_base_ || since > version) {
+        return false;
     }
+
+    changes.assign(origin_changes_.begin() + static_cast<size_t>(since - origin_changes_base_),
+                   origin_changes_.end());
     return true;
 }
 
@@ -98,16 +163,10 @@ void download_control_event_handler::handle_invoke_after_init(boost::function<vo
 
 void download_control_event_handler::set_disk_source()
 {
-    if(torrent_handle_.is_valid()) {
-        if(!torrent_handle_.is_seed()) {
-            libtorrent::bitfield pieces = torrent_handle_.status().pieces;
-            for(size_t i = 0; i < pieces.size(); ++i) {
-                if(pieces[i]) {
-                    piece_origin_[i] = disk_source_id;
-                }
-            }
-        } else {
-            std::fill(piece_origin_.begin(),piece_origin_.end(), disk_source_id);
+    // availability_ has been initialized from libtorrent before startup is signaled
+    for(int i = 0; i < piece_states_.num_pieces(); ++i) {
+        if(availability_.has_piece(i)) {
+            set_piece_origin(i, disk_source_id);
         }
     }
 }
@@ -140,34 +199,47 @@ void download_control_event_handler::handle_signal_startup_complete()
 void download_control_event_handler::signal_piece_finished(int piece_index)
 {
     disp_->post(
-        boost::bind(&download_control_event_handler::update_piece_requests, this, piece_index));
-    int source = 0;
-    
-    if(piece_index < static_cast<int>(piece_origin_.size())) {
-        source = piece_origin_[piece_index];
-    }
+        boost::bind(&download_control_event_handler::handle_piece_finished, this, piece_index));
+}
+
+void download_control_event_handler::handle_piece_finished(int piece_index)
+{
+    update_piece_requests(piece_index);
+
+    int source = piece_states_.origin(piece_index);
 
     if(source == 0) {
         // this piece originates from bittorrent since it hasn't been added by any other source
        source = bittorrent_source_id;
-       piece_origin_[piece_index] = source;
+       set_piece_origin(piece_index, source);
     }
     
-    disp_->post(
-        boost::bind(&download_control_event_handler::invoke_piece_finished_callback, this, piece_index,source));
+    invoke_piece_finished_callback(piece_index, source);
 }
 
 void download_control_event_handler::invoke_when_downloaded(const std::vector<chunk>& chunks, 
                                                             boost::function<void(std::vector<int>)> callback)
 {
     invoke_after_init(
-        boost::bind(&download_control_event_handler::handle_invoke_when_downloaded,
+        boost::bind(&download_control_event_handler::post_invoke_when_downloaded,
                     this,
                     chunks,
                     callback));
 
 }
 
+void download_control_event_handler::post_invoke_when_downloaded(const std::vector<chunk>& chunks, 
+                                                                 boost::function<void(std::vector<int>)> callback)
+{
+    // startup callbacks run on the callback worker, but the waiter index
+    // is only ever touched from disp_
+    disp_->post(
+        boost::bind(&download_control_event_handler::handle_invoke_when_downloaded,
+                    this,
+                    chunks,
+                    callback));
+}
+
 void download_control_event_handler::handle_invoke_when_downloaded(const std::vector<chunk>& chunks, 
                                                                    boost::function<void(std::vector<int>)> callback)
 {
@@ -187,24 +259,20 @@ void download_control_event_handler::handle_invoke_when_downloaded(const std::ve
         }
     }
 
-    // FIXME: map chunks to pieces
     std::vector<int> missing = missing_pieces(pieces);
+    
+    // a piece can be covered by more than one chunk, but it only
+    // finishes once
+    std::sort(missing.begin(), missing.end());
+    missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
     if(missing.size() != 0) {
-        std::list<int>* piece_list = new std::list<int>(missing.begin(),missing.end());
-        std::vector<int>* org_pieces = new std::vector<int>(pieces);
-        
-        piece_request req(piece_list,callback,org_pieces);
-        std::vector<libcow::piece_request> reqs;
-        
+        piece_waiter_ptr waiter(
+            new piece_waiter(pieces, callback, static_cast<int>(missing.size())));
+
         std::vector<int>::iterator it;
-        
         for(it = missing.begin(); it != missing.end(); ++it) {
-            int piece_id = *it;
-            {
-                piece_nr_to_request_.insert(std::pair<int,piece_request>(piece_id,req));
-            }
-            reqs.push_back(libcow::piece_request(
-                torrent_handle_.get_torrent_info().piece_length(), piece_id, 1));
+            piece_waiters_[*it].push_back(waiter);
         }
     } else {
         callback_worker_->post(
@@ -214,52 +282,38 @@ void download_control_event_handler::handle_invoke_when_downloaded(const std::ve
 
 void download_control_event_handler::update_piece_requests(int piece_id)
 {
-    std::pair<std::multimap<int,piece_request>::iterator,
-              std::multimap<int,piece_request>::iterator> bounds;
-    bounds = piece_nr_to_request_.equal_range(piece_id);
-    std::multimap<int,piece_request>::iterator it;
+    if(piece_id < 0 || piece_id >= static_cast<int>(piece_waiters_.size())) {
+        return;
+    }
+
+    std::vector<piece_waiter_ptr>& waiters = piece_waiters_[piece_id];
     
-    for(it = bounds.first; it != bounds.second; ++it) {
-        piece_request req = (*it).second;
-        std::list<int>* pieces = req.pieces_;
-        pieces->remove(piece_id);
-        if(pieces->size() == 0) {
-            std::vector<int> org_pieces = *(req.org_pieces_);
-            piece_request::callback func = req.callback_;
-            delete pieces;
-            delete req.org_pieces_;
+    std::vector<piece_waiter_ptr>::iterator it;
+    for(it = waiters.begin(); it != waiters.end(); ++it) {
+        piece_waiter& waiter = **it;
+        if(--waiter.outstanding_ == 0) {
             callback_worker_->post(
-                boost::bind(func, org_pieces));
+                boost::bind(waiter.callback_, waiter.pieces_));
         } 
     }
-    if(piece_nr_to_request_.find(piece_id) != piece_nr_to_request_.end()) {
-        piece_nr_to_request_.erase(piece_id);
-    }
+    
+    // keeps the capacity, so a piece that is waited for again
+    // doesn't allocate
+    waiters.clear();
 }
 
 std::vector<int> download_control_event_handler::missing_pieces(const std::vector<int>& pieces)
 {
-    libtorrent::torrent_status status = torrent_handle_.status();
     std::vector<int> missing;
     
-    if(status.state == libtorrent::torrent_status::seeding) {
-        return missing;
-    }
-	else if (status.state == libtorrent::torrent_status::downloading ||
-             status.state == libtorrent::torrent_status::finished)
-    {
-	    const libtorrent::bitfield& piece_status = status.pieces;
-        std::vector<int>::const_iterator it;
-		for (it = pieces.begin(); it != pieces.end(); ++it) {
-			int piece_idx = *it;
-            if (!piece_status[piece_idx]) {
-				missing.push_back(piece_idx);
-			}
-		}
-        return missing;
-	} else {
-        return pieces;
+    std::vector<int>::const_iterator it;
+    for (it = pieces.begin(); it != pieces.end(); ++it) {
+        int piece_idx = *it;
+        if (!availability_.has_piece(piece_idx)) {
+            missing.push_back(piece_idx);
+        }
     }
+    return missing;
 }
 
 void download_control_event_handler::invoke_piece_finished_callback(int piece_index,int device)
@@ -269,6 +323,29 @@ void download_control_event_handler::invoke_piece_finished_callback(int piece_in
             boost::bind(
                 piece_finished_callback_, piece_index, device));
     }
+
+    if(!pieces_finished_callback_.empty()) {
+        finished_batch_.push_back(std::make_pair(piece_index, device));
+        if(!flush_scheduled_) {
+            flush_timer_ = disp_->post_delayed(
+                boost::bind(&download_control_event_handler::flush_finished_pieces, this),
+                flush_interval_);
+            flush_scheduled_ = true;
+        }
+    }
+}
+
+void download_control_event_handler::flush_finished_pieces()
+{
+    flush_scheduled_ = false;
+    if(finished_batch_.empty() || pieces_finished_callback_.empty()) {
+        return;
+    }
+
+    piece_finished_batch batch;
+    batch.swap(finished_batch_);
+    callback_worker_->post(
+        boost::bind(pieces_finished_callback_, batch));
 }
 
 void download_control_event_handler::set_piece_finished_callback(const boost::function<void(int,int)>& func)
@@ -301,3 +378,40 @@ void download_control_event_handler::handle_unset_piece_finished_callback()
         piece_finished_callback_.clear();
     }
 }
+
+void download_control_event_handler::set_pieces_finished_callback(
+    const boost::function<void(const piece_finished_batch&)>& func, int flush_interval)
+{
+    disp_->post(boost::bind(
+        &download_control_event_handler::handle_set_pieces_finished_callback, this, func, flush_interval));
+}
+
+void download_control_event_handler::handle_set_pieces_finished_callback(
+    const boost::function<void(const piece_finished_batch&)>& func, int flush_interval)
+{
+    pieces_finished_callback_ = func;
+    flush_interval_ = flush_interval > 0 ? flush_interval : default_flush_interval;
+}
+
+void download_control_event_handler::unset_pieces_finished_callback()
+{
+    boost::function<void()> functor = 
+    boost::bind(&download_control_event_handler::handle_unset_pieces_finished_callback, this);
+    boost::packaged_task<void> task(functor);
+    boost::unique_future<void> future = task.get_future();
+
+    disp_->post(boost::bind(&boost::packaged_task<void>::operator(), 
+                boost::ref(task)));
+    future.wait();
+    return;
+}
+
+void download_control_event_handler::handle_unset_pieces_finished_callback()
+{
+    if(flush_scheduled_) {
+        disp_->cancel(flush_timer_);
+        flush_scheduled_ = false;
+    }
+    finished_batch_.clear();
+    pieces_finished_callback_.clear();
+}
@@ -3,27 +3,85 @@
 #include "cow/download_device.hpp"
 #include "cow/piece_request.hpp"
 #include "cow/dispatcher.hpp"
+#include "cow/piece_availability.hpp"
+#include "cow/piece_state_table.hpp"
 #include "cow/utils/chunk.hpp"
 
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
 
 #include <cmath>
+#include <algorithm>
+#include <cstdlib>
+#include <set>
 
 using namespace libcow;
 
+int download_control_worker::readahead_windows_ = 4;
+
+// the critical window in seconds of media, when the bitrate is known
+static const double default_critical_window_duration = 5.0;
+// how much the critical window may be stretched when the sources are slow
+static const double max_critical_window_stretch = 4.0;
+// the shortest time in seconds to measure each bitrate sample over
+static const double bitrate_sample_interval = 2.0;
+// playback that doesn't move for longer than this (in seconds) is paused or stalled
+static const double max_bitrate_sample_interval = 10.0;
+// forward jumps longer than this many bytes are treated as seeks
+static const size_t min_seek_distance = 8 * 1024 * 1024;
+// the weight of the latest sample in the bitrate estimate
+static const double bitrate_alpha = 0.2;
+// requests to random access devices that haven't been answered within
+// this many seconds are counted as failed (late requests are hedged long
+// before this, see set_critical_window_timeout)
+static const double request_timeout = 10.0;
+// a deadline is only moved if it changes by more than this many ms
+static const int min_deadline_change = 250;
+// pieces whose deadline is less than this many times the expected fetch
+// time of the fastest random access device away are requested right away
+static const double deadline_escalation_factor = 2.0;
+// how often in ms to check whether there is idle bandwidth for prefetching
+static const int prefetch_interval = 5000;
+// the number of likely seek targets to prefetch
+static const size_t max_prefetch_targets = 3;
+// the priority of prefetched pieces, below the tail of the critical windows
+static const int prefetch_priority = 4;
+// devices that fail more requests than this are only used if there are no others
+static const double max_healthy_error_rate = 0.5;
+
+static double seconds(const boost::posix_time::time_duration& duration)
+{
+    return duration.total_microseconds() / 1000000.0;
+}
+
 unsigned int download_control_worker::buffering_state_length_ = 10;
+const std::string download_control_worker::default_cursor = "default";
 
 download_control_worker::download_control_worker(libtorrent::torrent_handle& h,
+                                                 const piece_availability& availability,
+                                                 piece_state_table& piece_states,
                                                  size_t critical_window_length,
                                                  int critical_window_timeout)
     : critical_window_(critical_window_length),
+      critical_window_duration_(default_critical_window_duration),
+      critical_window_timeout_(critical_window_timeout),
+      bitrate_(0.0),
+      bittorrent_rate_(0.0),
+      scheduling_mode_(priority_scheduling),
       torrent_handle_(h),
-      buffering_state_counter_(0)
+      availability_(availability),
+      piece_states_(piece_states),
+      buffering_state_counter_(0),
+      readahead_piece_(-1),
+      will_need_end_(0),
+      dont_need_end_(0),
+      prefetcher_(h.get_torrent_info().piece_length())
 {
-    critically_requested_ = 
-        std::vector<bool>(torrent_handle_.get_torrent_info().num_pieces(), false);
+    delivered_by_ = std::vector<int>(torrent_handle_.get_torrent_info().num_pieces(), -1);
+    pre_buffer_priorities_ = std::vector<int>(torrent_handle_.get_torrent_info().num_pieces(), 0);
     disp_ = new dispatcher(critical_window_timeout);
+    disp_->post_periodic(
+        boost::bind(&download_control_worker::prefetch_seek_targets, this), prefetch_interval);
 
     is_running_ = true;
 }
@@ -32,6 +90,11 @@ download_control_worker::~download_control_worker()
 {
     delete disp_;
     download_devices_.clear();
+
+    // the dispatcher thread is gone, so this can't race with a seek
+    if(!seek_history_path_.empty() && !prefetcher_.empty()) {
+        prefetcher_.save(seek_history_path_);
+    }
 }
 
 void download_control_worker::set_critical_window(size_t length)
@@ -45,6 +108,546 @@ void download_control_worker::handle_set_critical_window(size_t length)
     critical_window_ = length;
 }
 
+void download_control_worker::set_critical_window_duration(double seconds)
+{
+    disp_->post(boost::bind(
+        &download_control_worker::handle_set_critical_window_duration, this, seconds));
+}
+
+void download_control_worker::handle_set_critical_window_duration(double seconds)
+{
+    critical_window_duration_ = seconds;
+}
+
+void download_control_worker::set_scheduling_mode(scheduling_mode mode)
+{
+    disp_->post(boost::bind(
+        &download_control_worker::handle_set_scheduling_mode, this, mode));
+}
+
+void download_control_worker::handle_set_scheduling_mode(scheduling_mode mode)
+{
+    if(mode != deadline_scheduling) {
+        clear_deadlines();
+    }
+    scheduling_mode_ = mode;
+}
+
+double download_control_worker::time_until_played(size_t offset, int piece_index, int num_window_pieces)
+{
+    size_t piece_start = static_cast<size_t>(piece_index) * torrent_handle_.get_torrent_info().piece_length();
+    if(piece_start <= offset) {
+        return 0.0;
+    }
+    if(bitrate_ > 0.0) {
+        return (piece_start - offset) / bitrate_;
+    }
+    // without a bitrate, assume that the critical window lasts its duration
+    double window_bytes = std::max(num_window_pieces, 1) * 
+        static_cast<double>(torrent_handle_.get_torrent_info().piece_length());
+    return (piece_start - offset) / window_bytes * critical_window_duration_;
+}
+
+void download_control_worker::update_deadlines()
+{
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    // the deadline in ms of each missing piece in the critical windows, the
+    // earliest one when the windows of several cursors overlap
+    std::map<int, int> deadlines;
+    std::map<std::string, playback_cursor>::iterator cursor_it;
+    for(cursor_it = cursors_.begin(); cursor_it != cursors_.end(); ++cursor_it) {
+        const playback_cursor& cursor = cursor_it->second;
+        int end_piece = std::min(cursor.first_piece + 2*cursor.num_window_pieces, 
+                                 availability_.num_pieces());
+        for(int i = cursor.first_piece; i < end_piece; ++i) {
+            if(availability_.has_piece(i)) {
+                continue;
+            }
+            int deadline = static_cast<int>(
+                time_until_played(cursor.offset, i, cursor.num_window_pieces) * 1000);
+            std::map<int, int>::iterator it = deadlines.find(i);
+            if(it == deadlines.end() || deadline < it->second) {
+                deadlines[i] = deadline;
+            }
+        }
+    }
+
+    // pieces that are no longer ahead of a playback position lose their deadlines
+    std::map<int, boost::posix_time::ptime>::iterator it = piece_deadlines_.begin();
+    while(it != piece_deadlines_.end()) {
+        if(availability_.has_piece(it->first)) {
+            piece_deadlines_.erase(it++);
+        } else if(deadlines.find(it->first) == deadlines.end()) {
+            torrent_handle_.reset_piece_deadline(it->first);
+            piece_deadlines_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+
+    std::map<int, int>::iterator deadline_it;
+    for(deadline_it = deadlines.begin(); deadline_it != deadlines.end(); ++deadline_it) {
+        boost::posix_time::ptime due = now + boost::posix_time::milliseconds(deadline_it->second);
+
+        std::map<int, boost::posix_time::ptime>::iterator old_it = piece_deadlines_.find(deadline_it->first);
+        if(old_it != piece_deadlines_.end() &&
+           abs(static_cast<int>((due - old_it->second).total_milliseconds())) <= min_deadline_change)
+        {
+            continue;
+        }
+        torrent_handle_.set_piece_deadline(deadline_it->first, deadline_it->second);
+        piece_deadlines_[deadline_it->first] = due;
+    }
+}
+
+void download_control_worker::clear_deadlines()
+{
+    std::map<int, boost::posix_time::ptime>::iterator it;
+    for(it = piece_deadlines_.begin(); it != piece_deadlines_.end(); ++it) {
+        if(!availability_.has_piece(it->first)) {
+            torrent_handle_.reset_piece_deadline(it->first);
+        }
+    }
+    piece_deadlines_.clear();
+}
+
+int download_control_worker::last_late_piece(size_t offset, int first_piece, int num_pieces)
+{
+    // how long the fastest random access device is expected to take for a piece
+    double fetch_time = -1.0;
+    std::vector<boost::shared_ptr<download_device> >::iterator it;
+    for(it = download_devices_.begin(); it != download_devices_.end(); ++it) {
+        download_device* dev = it->get();
+        if(dev && dev->is_random_access()) {
+            double time = device_stats_[dev->id()].expected_completion(
+                torrent_handle_.get_torrent_info().piece_length());
+            if(fetch_time < 0.0 || time < fetch_time) {
+                fetch_time = time;
+            }
+        }
+    }
+    if(fetch_time < 0.0) {
+        return -1;
+    }
+
+    // the deadlines grow with the piece index, so the late pieces come first
+    int last_piece = -1;
+    int end_piece = std::min(first_piece + num_pieces, availability_.num_pieces());
+    for(int i = first_piece; i < end_piece; ++i) {
+        if(time_until_played(offset, i, num_pieces / 2) >= deadline_escalation_factor * fetch_time) {
+            break;
+        }
+        last_piece = i;
+    }
+    return last_piece;
+}
+
+void download_control_worker::report_pieces_received(int device_id, 
+                                                     const std::vector<int>& pieces, 
+                                                     size_t bytes,
+                                                     int num_rejected)
+{
+    disp_->post(boost::bind(
+        &download_control_worker::handle_report_pieces_received, this, 
+        device_id, pieces, bytes, num_rejected));
+}
+
+void download_control_worker::handle_report_pieces_received(int device_id, 
+                                                            const std::vector<int>& pieces, 
+                                                            size_t bytes,
+                                                            int num_rejected)
+{
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    device_rates_[device_id].add(bytes, now);
+
+    if(num_rejected > 0) {
+        device_stats_[device_id].request_failed(0);
+    }
+
+    const libtorrent::torrent_info& torrent_info = torrent_handle_.get_torrent_info();
+    typedef std::multimap<int, boost::shared_ptr<request_batch> >::iterator request_iterator;
+    // the hedged requests that lost the race, by device id
+    std::map<int, std::vector<int> > lost_pieces;
+    std::vector<int>::const_iterator it;
+    for(it = pieces.begin(); it != pieces.end(); ++it) {
+        std::pair<request_iterator, request_iterator> range = outstanding_requests_.equal_range(*it);
+        request_iterator req_it = range.first;
+        while(req_it != range.second && req_it->second->device_id != device_id) {
+            ++req_it;
+        }
+        if(req_it == range.second) {
+            // the piece wasn't requested from this device, or lost to a hedged request
+            if(delivered_by_[*it] < 0) {
+                delivered_by_[*it] = device_id;
+            }
+            continue;
+        }
+        delivered_by_[*it] = device_id;
+        boost::shared_ptr<request_batch> batch = req_it->second;
+        outstanding_requests_.erase(req_it);
+
+        // the other request for a hedged piece isn't needed anymore
+        range = outstanding_requests_.equal_range(*it);
+        for(request_iterator other = range.first; other != range.second; ) {
+            const request_batch& loser = *other->second;
+            if(loser.sent < batch->sent && loser.first_arrival.is_not_a_date_time()) {
+                // the device that was hedged took at least this long to answer
+                device_stats_[loser.device_id].add_latency(seconds(now - loser.sent));
+            }
+            lost_pieces[loser.device_id].push_back(*it);
+            drop_request(other++);
+        }
+
+        size_t piece_size = torrent_info.piece_size(*it);
+        device_statistics& stats = device_stats_[device_id];
+        stats.bytes_delivered(piece_size);
+
+        if(batch->failed) {
+            continue;
+        }
+        if(batch->first_arrival.is_not_a_date_time()) {
+            batch->first_arrival = now;
+            stats.add_latency(seconds(now - batch->sent));
+        }
+        if(batch->first_arrival == now) {
+            batch->first_bytes += piece_size;
+        }
+
+        if(--batch->pieces_left == 0) {
+            /* Devices that deliver a whole request at once only show the
+             * effective throughput, including the latency. When the pieces
+             * trickle in, the rate after the first arrival is used.
+             */
+            double transfer_time = seconds(now - batch->first_arrival);
+            if(transfer_time > 0.0) {
+                stats.add_throughput((batch->bytes - batch->first_bytes) / transfer_time);
+            } else {
+                stats.add_throughput(batch->bytes / std::max(seconds(now - batch->sent), 0.001));
+            }
+            stats.request_succeeded();
+        }
+    }
+
+    // so that the losing devices stop transferring them
+    cancel_device_pieces(lost_pieces);
+}
+
+void download_control_worker::report_hash_failed(int piece_index)
+{
+    disp_->post(boost::bind(
+        &download_control_worker::handle_report_hash_failed, this, piece_index));
+}
+
+void download_control_worker::handle_report_hash_failed(int piece_index)
+{
+    piece_states_.set_requested(piece_index, false);
+
+    int device_id = delivered_by_[piece_index];
+    if(device_id >= 0) {
+        device_stats_[device_id].request_failed(0);
+        delivered_by_[piece_index] = -1;
+    }
+}
+
+void download_control_worker::stripe_requests(const std::vector<libcow::piece_request>& reqs,
+                                              std::vector<request_stripe>& stripes,
+                                              int excluded_device)
+{
+    // only use devices that fail too often if there is nothing else
+    std::vector<download_device*> devices;
+    for(int pass = 0; pass < 2 && devices.empty(); ++pass) {
+        std::vector<boost::shared_ptr<download_device> >::iterator it;
+        for(it = download_devices_.begin(); it != download_devices_.end(); ++it) {
+            download_device* dev = it->get();
+            if(dev && dev->is_random_access() && dev->id() != excluded_device &&
+               (pass > 0 || device_stats_[dev->id()].error_rate() <= max_healthy_error_rate))
+            {
+                devices.push_back(dev);
+            }
+        }
+    }
+    if(devices.empty()) {
+        return;
+    }
+
+    /* Decide how many pieces each device gets by handing out the pieces one
+     * by one to the device that would finish first with it. This splits the
+     * pieces in proportion to the capacity of the devices, and keeps devices
+     * with a high latency out of small requests.
+     */
+    const libtorrent::torrent_info& torrent_info = torrent_handle_.get_torrent_info();
+    std::vector<size_t> assigned_bytes(devices.size(), 0);
+    std::vector<size_t> num_assigned(devices.size(), 0);
+
+    std::vector<libcow::piece_request>::const_iterator req_it;
+    for(req_it = reqs.begin(); req_it != reqs.end(); ++req_it) {
+        size_t piece_size = torrent_info.piece_size(req_it->index);
+        size_t best = 0;
+        double best_time = 0.0;
+        for(size_t i = 0; i < devices.size(); ++i) {
+            double time = device_stats_[devices[i]->id()].expected_completion(
+                assigned_bytes[i] + piece_size);
+            if(i == 0 || time < best_time) {
+                best = i;
+                best_time = time;
+            }
+        }
+        assigned_bytes[best] += piece_size;
+        ++num_assigned[best];
+    }
+
+    // the fastest device gets the pieces nearest the playback position
+    std::vector<std::pair<double, size_t> > order;
+    for(size_t i = 0; i < devices.size(); ++i) {
+        if(num_assigned[i] > 0) {
+            double time = device_stats_[devices[i]->id()].expected_completion(
+                torrent_info.piece_length());
+            order.push_back(std::make_pair(time, i));
+        }
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<libcow::piece_request>::const_iterator first = reqs.begin();
+    std::vector<std::pair<double, size_t> >::iterator order_it;
+    for(order_it = order.begin(); order_it != order.end(); ++order_it) {
+        size_t count = num_assigned[order_it->second];
+        stripes.push_back(request_stripe(devices[order_it->second], 
+                                         std::vector<libcow::piece_request>(first, first + count)));
+        first += count;
+    }
+}
+
+void download_control_worker::expire_requests(const boost::posix_time::ptime& now)
+{
+    std::multimap<int, boost::shared_ptr<request_batch> >::iterator it = outstanding_requests_.begin();
+    while(it != outstanding_requests_.end()) {
+        boost::shared_ptr<request_batch> batch = it->second;
+        if(seconds(now - batch->sent) < request_timeout) {
+            ++it;
+            continue;
+        }
+
+        if(!batch->failed) {
+            BOOST_LOG_TRIVIAL(debug) << "download_control_worker: request to device " 
+                                     << batch->device_id << " timed out";
+            device_stats_[batch->device_id].request_failed(0);
+            batch->failed = true;
+        }
+
+        int piece_index = it->first;
+        drop_request(it++);
+
+        // the piece may be requested again, unless a hedged request is still waiting
+        if(outstanding_requests_.count(piece_index) == 0) {
+            piece_states_.set_requested(piece_index, false);
+        }
+    }
+}
+
+void download_control_worker::hedge_late_requests(int first_piece, 
+                                                  int last_piece, 
+                                                  const boost::posix_time::ptime& now)
+{
+    const libtorrent::torrent_info& torrent_info = torrent_handle_.get_torrent_info();
+    boost::posix_time::time_duration timeout = 
+        boost::posix_time::milliseconds(critical_window_timeout_);
+
+    // the pieces that are late, by the device that they were requested from
+    std::map<int, std::vector<libcow::piece_request> > late_pieces;
+
+    std::multimap<int, boost::shared_ptr<request_batch> >::iterator it = 
+        outstanding_requests_.lower_bound(first_piece);
+    std::multimap<int, boost::shared_ptr<request_batch> >::iterator end = 
+        outstanding_requests_.upper_bound(last_piece);
+    while(it != end) {
+        int piece_index = it->first;
+        // pieces that are already hedged are left to the timeout
+        if(outstanding_requests_.count(piece_index) == 1 && 
+           now - it->second->sent > timeout && 
+           !availability_.has_piece(piece_index)) 
+        {
+            late_pieces[it->second->device_id].push_back(
+                piece_request(torrent_info.piece_length(), piece_index, 1));
+        }
+        it = outstanding_requests_.upper_bound(piece_index);
+    }
+
+    std::map<int, std::vector<libcow::piece_request> >::iterator late_it;
+    for(late_it = late_pieces.begin(); late_it != late_pieces.end(); ++late_it) {
+        std::vector<request_stripe> stripes;
+        stripe_requests(late_it->second, stripes, late_it->first);
+
+        std::vector<request_stripe>::iterator stripe_it;
+        for(stripe_it = stripes.begin(); stripe_it != stripes.end(); ++stripe_it) {
+            BOOST_LOG_TRIVIAL(debug) << "download_control_worker: requesting " 
+                                     << stripe_it->second.size() << " late pieces from device "
+                                     << late_it->first << " from device " 
+                                     << stripe_it->first->id() << " as well";
+            send_requests(stripe_it->first, stripe_it->second, now, true);
+        }
+    }
+}
+
+void download_control_worker::cancel_stale_requests(const std::vector<piece_range>& old_windows)
+{
+    // the requests for the old windows that no cursor needs anymore, by device id
+    std::map<int, std::vector<int> > stale_pieces;
+
+    std::vector<piece_range>::const_iterator window_it;
+    for(window_it = old_windows.begin(); window_it != old_windows.end(); ++window_it) {
+        std::multimap<int, boost::shared_ptr<request_batch> >::iterator it = 
+            outstanding_requests_.lower_bound(window_it->first);
+        std::multimap<int, boost::shared_ptr<request_batch> >::iterator end = 
+            outstanding_requests_.lower_bound(window_it->second);
+        while(it != end) {
+            int piece_index = it->first;
+            if(in_cursor_window(piece_index)) {
+                ++it;
+                continue;
+            }
+            stale_pieces[it->second->device_id].push_back(piece_index);
+            piece_states_.set_requested(piece_index, false);
+            drop_request(it++);
+        }
+    }
+
+    cancel_device_pieces(stale_pieces);
+}
+
+void download_control_worker::cancel_device_pieces(const std::map<int, std::vector<int> >& pieces)
+{
+    std::map<int, std::vector<int> >::const_iterator it;
+    for(it = pieces.begin(); it != pieces.end(); ++it) {
+        std::vector<boost::shared_ptr<download_device> >::iterator dev_it;
+        for(dev_it = download_devices_.begin(); dev_it != download_devices_.end(); ++dev_it) {
+            if(dev_it->get() && (*dev_it)->id() == it->first) {
+                BOOST_LOG_TRIVIAL(debug) << "download_control_worker: cancelling " 
+                                         << it->second.size() << " requests to device "
+                                         << it->first;
+                (*dev_it)->cancel_pieces(it->second);
+                break;
+            }
+        }
+    }
+}
+
+void download_control_worker::drop_request(std::multimap<int, boost::shared_ptr<request_batch> >::iterator it)
+{
+    // the piece no longer counts as queued at the device
+    device_stats_[it->second->device_id].bytes_delivered(
+        torrent_handle_.get_torrent_info().piece_size(it->first));
+    --it->second->pieces_left;
+    outstanding_requests_.erase(it);
+}
+
+void download_control_worker::update_bitrate(playback_cursor& cursor, size_t offset)
+{
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    if(cursor.bitrate_sample_time.is_not_a_date_time()) {
+        cursor.bitrate_sample_time = now;
+        cursor.bitrate_sample_offset = offset;
+        return;
+    }
+
+    double elapsed = (now - cursor.bitrate_sample_time).total_microseconds() / 1000000.0;
+    size_t max_distance = std::max(min_seek_distance, 
+                                   static_cast<size_t>(4 * bitrate_ * elapsed));
+
+    /* Start over after seeks, and don't count the time that playback 
+     * was paused or stalled, since that says nothing about the bitrate.
+     */
+    if(offset < cursor.bitrate_sample_offset || 
+       offset - cursor.bitrate_sample_offset > max_distance ||
+       elapsed > max_bitrate_sample_interval ||
+       offset == cursor.bitrate_sample_offset)
+    {
+        cursor.bitrate_sample_time = now;
+        cursor.bitrate_sample_offset = offset;
+        return;
+    }
+
+    if(elapsed < bitrate_sample_interval) {
+        return;
+    }
+
+    double sample = (offset - cursor.bitrate_sample_offset) / elapsed;
+    bitrate_ = bitrate_ > 0.0 ? bitrate_alpha * sample + (1.0 - bitrate_alpha) * bitrate_ : sample;
+    cursor.bitrate_sample_time = now;
+    cursor.bitrate_sample_offset = offset;
+}
+
+double download_control_worker::source_throughput()
+{
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    // torrent_handle::status is a round-trip to the libtorrent thread
+    if(bittorrent_rate_time_.is_not_a_date_time() || 
+       now - bittorrent_rate_time_ > boost::posix_time::seconds(1)) 
+    {
+        bittorrent_rate_ = torrent_handle_.status().download_payload_rate;
+        bittorrent_rate_time_ = now;
+    }
+
+    double throughput = bittorrent_rate_;
+    std::map<int, rate_estimator>::iterator it;
+    for(it = device_rates_.begin(); it != device_rates_.end(); ++it) {
+        throughput += it->second.rate(now);
+    }
+    return throughput;
+}
+
+size_t download_control_worker::critical_window_bytes()
+{
+    if(bitrate_ <= 0.0) {
+        return critical_window_;
+    }
+
+    size_t window = std::max(critical_window_, 
+                             static_cast<size_t>(bitrate_ * critical_window_duration_));
+
+    /* When the sources can't keep up with playback, request further ahead.
+     * The throughput is measured from what is delivered, so it only says
+     * something while there is data left to deliver: idle sources would
+     * otherwise look slow and stretch the window for nothing.
+     */
+    if(!window_has_demand(window)) {
+        return window;
+    }
+
+    double stretch = 1.0;
+    double throughput = source_throughput();
+    if(throughput < bitrate_) {
+        stretch = throughput > bitrate_ / max_critical_window_stretch ?
+            bitrate_ / throughput : max_critical_window_stretch;
+    }
+
+    return std::max(critical_window_, 
+                    static_cast<size_t>(bitrate_ * critical_window_duration_ * stretch));
+}
+
+bool download_control_worker::window_has_demand(size_t window_bytes)
+{
+    if(availability_.is_complete()) {
+        return false;
+    }
+    if(!outstanding_requests_.empty()) {
+        return true;
+    }
+
+    size_t piece_length = torrent_handle_.get_torrent_info().piece_length();
+    std::map<std::string, playback_cursor>::iterator it;
+    for(it = cursors_.begin(); it != cursors_.end(); ++it) {
+        int first_piece = it->second.offset / piece_length;
+        int last_piece = std::min(static_cast<int>((it->second.offset + window_bytes - 1) / piece_length),
+                                  availability_.num_pieces() - 1);
+        if(first_piece <= last_piece && !availability_.has_pieces(first_piece, last_piece)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void download_control_worker::set_critical_window_timeout(int timeout)
 {
     disp_->post(boost::bind(
@@ -53,7 +656,12 @@ void download_control_worker::set_critical_window_timeout(int timeout)
 
 void download_control_worker::handle_set_critical_window_timeout(int timeout)
 {
-    // FIXME: implement this
+    if(timeout <= 0) {
+        BOOST_LOG_TRIVIAL(warning) << "download_control_worker: ignoring critical window timeout "
+                                   << timeout << " ms";
+        return;
+    }
+    critical_window_timeout_ = timeout;
 }
         
 void download_control_worker::set_piece_requested(int piece_index, bool req)
@@ -66,7 +674,7 @@ void download_control_worker::set_piece_requested(int piece_index, bool req)
 
 void download_control_worker::handle_set_piece_requested(int piece_index, bool req)
 {
-    critically_requested_[piece_index] = req;
+    piece_states_.set_requested(piece_index, req);
 }
 
 void download_control_worker::add_download_device(download_device* dd)
@@ -85,19 +693,62 @@ void download_control_worker::handle_add_download_device(download_device* dd)
 void download_control_worker::pre_buffer(const chunk& c)
 {
     disp_->post(boost::bind(
-        &download_control_worker::handle_download_strategy, this, c, true, true));
+        &download_control_worker::handle_pre_buffer, this, c));
 
 }
 
 void download_control_worker::set_playback_position(size_t offset, bool force_request)
+{
+    set_playback_position(default_cursor, offset, force_request);
+}
+
+void download_control_worker::set_playback_position(const std::string& cursor, 
+                                                    size_t offset, 
+                                                    bool force_request)
 {
     disp_->post(boost::bind(
-        &download_control_worker::handle_set_playback_position, this, offset, force_request));
+        &download_control_worker::handle_set_playback_position, this, cursor, offset, force_request));
 }
 
-void download_control_worker::handle_set_playback_position(size_t offset, bool force_request)
+void download_control_worker::remove_playback_cursor(const std::string& cursor)
 {
-    handle_download_strategy(chunk(offset, critical_window_), force_request, false);
+    disp_->post(boost::bind(
+        &download_control_worker::handle_remove_playback_cursor, this, cursor));
+}
+
+void download_control_worker::handle_set_playback_position(const std::string& name, 
+                                                           size_t offset, 
+                                                           bool force_request)
+{
+    std::vector<piece_range> old_windows;
+    cursor_windows(old_windows);
+
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    bool is_new = cursors_.find(name) == cursors_.end();
+
+    playback_cursor& cursor = cursors_[name];
+    update_bitrate(cursor, offset);
+    if(name == default_cursor) {
+        // where playback is resumed counts as a seek as well
+        if(!seek_history_path_.empty() && (is_new ? offset > 0 : is_seek(cursor, offset, now))) {
+            prefetcher_.record_seek(offset);
+        }
+        update_readahead(offset);
+    }
+    cursor.offset = offset;
+    cursor.updated = now;
+
+    update_strategy(old_windows, force_request);
+}
+
+void download_control_worker::handle_remove_playback_cursor(const std::string& name)
+{
+    std::vector<piece_range> old_windows;
+    cursor_windows(old_windows);
+
+    if(cursors_.erase(name) > 0) {
+        update_strategy(old_windows, false);
+    }
 }
         
 std::map<int,std::string> download_control_worker::get_device_names()
@@ -131,144 +782,381 @@ std::map<int,std::string> download_control_worker::handle_get_device_names()
     return devices;
 }
 
-void download_control_worker::handle_download_strategy(const chunk& c, bool force_request, bool pre_buffer)
+void download_control_worker::cursor_windows(std::vector<piece_range>& windows)
+{
+    std::map<std::string, playback_cursor>::iterator it;
+    for(it = cursors_.begin(); it != cursors_.end(); ++it) {
+        windows.push_back(piece_range(it->second.first_piece, it->second.end_piece));
+    }
+}
+
+bool download_control_worker::in_cursor_window(int piece_index)
+{
+    std::map<std::string, playback_cursor>::iterator it;
+    for(it = cursors_.begin(); it != cursors_.end(); ++it) {
+        if(piece_index >= it->second.first_piece && piece_index < it->second.end_piece) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool download_control_worker::has_random_access_device()
+{
+    std::vector<boost::shared_ptr<download_device> >::iterator it;
+    for(it = download_devices_.begin(); it != download_devices_.end(); ++it) {
+        download_device* dev = it->get();
+        if(dev && dev->is_random_access()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void download_control_worker::reset_desired_priorities()
+{
+    /* The priorities are worked out on a copy of the ones that were applied
+     * last time, and only handed to libtorrent, in a single call, if they
+     * changed. Each piece_priority call is a message to the libtorrent thread.
+     */
+    if(applied_priorities_.empty()) {
+        applied_priorities_ = torrent_handle_.piece_priorities();
+    }
+    desired_priorities_ = applied_priorities_;
+}
+
+int download_control_worker::prioritize_window(int first_piece, int num_window_pieces)
+{
+    // the most critical pieces get the highest priority, followed by a tail
+    // of descending priorities. Overlapping windows keep the highest one.
+    int end_piece = std::min(first_piece + 4*num_window_pieces, availability_.num_pieces());
+    for(int i = first_piece; i < end_piece; ++i) {
+        desired_priorities_[i] = std::max(desired_priorities_[i], 
+                                          window_priority(i, first_piece, num_window_pieces));
+    }
+    return end_piece;
+}
+
+int download_control_worker::window_priority(int piece_index, int first_piece, int num_window_pieces)
+{
+    return piece_index < first_piece + 2*num_window_pieces ? 7 :
+           piece_index < first_piece + 3*num_window_pieces ? 6 : 5;
+}
+
+int download_control_worker::background_priority(int piece_index)
+{
+    // the priority a piece keeps when no cursor window covers it
+    int priority = std::max(1, pre_buffer_priorities_[piece_index]);
+    std::vector<piece_range>::const_iterator it;
+    for(it = prefetch_ranges_.begin(); it != prefetch_ranges_.end(); ++it) {
+        if(piece_index >= it->first && piece_index < it->second) {
+            priority = std::max(priority, prefetch_priority);
+        }
+    }
+    return priority;
+}
+
+void download_control_worker::apply_desired_priorities()
+{
+    if(desired_priorities_ != applied_priorities_) {
+        torrent_handle_.prioritize_pieces(desired_priorities_);
+        applied_priorities_.swap(desired_priorities_);
+    }
+}
+
+void download_control_worker::handle_pre_buffer(const chunk& c)
 {
     // don't fiddle with download strategies if seeding
-    if(torrent_handle_.status().state == libtorrent::torrent_status::seeding) {
+    if(availability_.is_complete()) {
         return;
     }
 
-    assert(c.offset() >= 0);
+    const libtorrent::torrent_info& torrent_info = torrent_handle_.get_torrent_info();
+    int first_piece = c.offset() / torrent_info.piece_length();
+    int num_window_pieces = 
+        static_cast<int>(floor((c.offset() + c.length()) * 1.0 / torrent_info.piece_length()))
+            - first_piece + 1;
+
+    reset_desired_priorities();
+    int end_piece = prioritize_window(first_piece, num_window_pieces);
+    apply_desired_priorities();
+    for(int i = first_piece; i < end_piece; ++i) {
+        pre_buffer_priorities_[i] = std::max(pre_buffer_priorities_[i], 
+                                             window_priority(i, first_piece, num_window_pieces));
+    }
+
+    // explicit pre buffering requests right away, and requests pieces again
+    if(has_random_access_device()) {
+        std::vector<piece_range> ranges(1, piece_range(first_piece, 
+            std::min(first_piece + num_window_pieces, torrent_info.num_pieces())));
+        disp_->post(
+            boost::bind(&download_control_worker::fetch_missing_pieces, this, ranges, true));
+    }
+}
+
+void download_control_worker::update_strategy(const std::vector<piece_range>& old_windows, 
+                                              bool force_request)
+{
+    // don't fiddle with download strategies if seeding
+    if(availability_.is_complete()) {
+        return;
+    }
 
-    // create a vector of pieces to
     const libtorrent::torrent_info& torrent_info = torrent_handle_.get_torrent_info();
-    int first_piece_to_prioritize = c.offset() / torrent_info.piece_length();
-    // "greedy" mapping from bytes to pieces. 
-    // the total size (in bytes) of the priorizied pieces will at least be 'length'.
+    size_t window_bytes = critical_window_bytes();
 
-    int num_pieces_in_critical_window = 
-        static_cast<int>(floor((c.offset() + c.length()) * 1.0 / torrent_info.piece_length()))
-            - first_piece_to_prioritize + 1;
-    
-    //std::cout << "first_piece_to_prioritize: " << first_piece_to_prioritize << std::endl;
+    int first_cursor_piece = torrent_info.num_pieces();
+    std::map<std::string, playback_cursor>::iterator it;
+    for(it = cursors_.begin(); it != cursors_.end(); ++it) {
+        playback_cursor& cursor = it->second;
+        cursor.first_piece = cursor.offset / torrent_info.piece_length();
+        // "greedy" mapping from bytes to pieces. 
+        // the total size (in bytes) of the priorizied pieces will at least be the critical window.
+        cursor.num_window_pieces = 
+            static_cast<int>(floor((cursor.offset + window_bytes) * 1.0 / torrent_info.piece_length()))
+                - cursor.first_piece + 1;
+        cursor.end_piece = std::min(cursor.first_piece + 4*cursor.num_window_pieces, 
+                                    torrent_info.num_pieces());
+        first_cursor_piece = std::min(first_cursor_piece, cursor.first_piece);
+    }
 
-    if(buffering_state_counter_ > buffering_state_length_ && !pre_buffer) {
-        // set low priority for pieces before playback position unless we're buffering
-        for(int i = 0; i < first_piece_to_prioritize; ++i) {
-            torrent_handle_.piece_priority(i, 1);
+    reset_desired_priorities();
+
+    if(buffering_state_counter_ > buffering_state_length_ && !cursors_.empty()) {
+        // set low priority for pieces before the playback positions unless we're buffering
+        for(int i = 0; i < first_cursor_piece; ++i) {
+            desired_priorities_[i] = 1;
         }
     }
 
-    int counter = 0;
-    // set highest priority for the most critical pieces
-    for(int i = 0; i < 2*num_pieces_in_critical_window; ++i, ++counter) {
-        int idx = first_piece_to_prioritize + counter;
-        if(idx >= torrent_info.num_pieces()) break;
-        torrent_handle_.piece_priority(idx, 7);
+    /* The pieces that were prioritized for the old playback positions go 
+     * back to the priority they had without a cursor window, unless a cursor
+     * still needs them, and the random access requests for them are 
+     * cancelled. After a seek, they would otherwise compete with the new 
+     * critical window. Pre buffered and prefetched pieces keep their tiers.
+     */
+    std::vector<piece_range>::const_iterator window_it;
+    for(window_it = old_windows.begin(); window_it != old_windows.end(); ++window_it) {
+        for(int i = window_it->first; i < window_it->second; ++i) {
+            if(desired_priorities_[i] > 1) {
+                desired_priorities_[i] = std::min(desired_priorities_[i], background_priority(i));
+            }
+        }
     }
-    // create a tail of descending priorities
-    for(int i = 0; i < num_pieces_in_critical_window; ++i, ++counter) {
-        int idx = first_piece_to_prioritize + counter;
-        if(idx >= torrent_info.num_pieces()) break;
-        torrent_handle_.piece_priority(idx, 6);
+    for(it = cursors_.begin(); it != cursors_.end(); ++it) {
+        prioritize_window(it->second.first_piece, it->second.num_window_pieces);
     }
-    for(int i = 0; i < num_pieces_in_critical_window; ++i, ++counter) {
-        int idx = first_piece_to_prioritize + counter;
-        if(idx >= torrent_info.num_pieces()) break;
-        torrent_handle_.piece_priority(idx, 5);
+    apply_desired_priorities();
+    cancel_stale_requests(old_windows);
+
+    bool use_deadlines = scheduling_mode_ == deadline_scheduling;
+    if(use_deadlines) {
+        update_deadlines();
     }
 
-    // get an up to date list of random access devices
-    std::vector<download_device*> random_access_devices;
+    // the device is picked when the request is made, see fetch_missing_pieces
+    if(cursors_.empty() || !has_random_access_device()) {
+        return;
+    }
 
-    std::vector<boost::shared_ptr<download_device> >::iterator it;
+    std::vector<piece_range> windows;
+    std::vector<piece_range> late_ranges;
+    bool windows_full = true;
+    for(it = cursors_.begin(); it != cursors_.end(); ++it) {
+        const playback_cursor& cursor = it->second;
+        piece_range window(cursor.first_piece, 
+                           std::min(cursor.first_piece + cursor.num_window_pieces, 
+                                    torrent_info.num_pieces()));
+        windows.push_back(window);
+        if(!availability_.has_pieces(window.first, window.second - 1)) {
+            windows_full = false;
+        }
 
-    for(it = download_devices_.begin(); it != download_devices_.end(); ++it)
-    {
-        download_device* dev = it->get();
-        if(dev && dev->is_random_access()) {
-            random_access_devices.push_back(dev);
+        if(use_deadlines) {
+            // don't wait for the timeout with pieces that bittorrent is unlikely to deliver in time
+            int last_late_piece_index = last_late_piece(cursor.offset, cursor.first_piece, 
+                                                        2*cursor.num_window_pieces);
+            if(last_late_piece_index >= cursor.first_piece) {
+                late_ranges.push_back(piece_range(cursor.first_piece, last_late_piece_index + 1));
+            }
         }
     }
-    
-    if(random_access_devices.size() > 0) {
-        // load balancing
-        int device_index = rand() % random_access_devices.size();
+    if(!late_ranges.empty()) {
+        fetch_missing_pieces(late_ranges, false);
+    }
 
-        download_device* dev = random_access_devices[device_index];
-        
-        /* for the first buffering_state_length_ pieces, don't delay the
-         * random access requests (speeds up pre-buffering) */
-        if(buffering_state_counter_ <= buffering_state_length_ || pre_buffer)
-        {    
-            disp_->post(
-                boost::bind(&download_control_worker::fetch_missing_pieces, this, 
-                            dev,
-                            first_piece_to_prioritize, 
-                            first_piece_to_prioritize + num_pieces_in_critical_window - 1,
-                            force_request,
-                            boost::system::error_code()));
-            // explicit pre buffering is not considered part of the (implicit) buffering stage.
-            if(!pre_buffer) {
-                ++buffering_state_counter_;
+    /* for the first buffering_state_length_ pieces, don't delay the
+     * random access requests (speeds up pre-buffering) */
+    if(buffering_state_counter_ <= buffering_state_length_)
+    {    
+        disp_->post(
+            boost::bind(&download_control_worker::fetch_window_pieces, this, 
+                        windows,
+                        force_request));
+        ++buffering_state_counter_;
+        // the buffer is already full when the whole critical windows have been downloaded
+        if(windows_full) {
+            buffering_state_counter_ = buffering_state_length_ + 1;
+        }
 #ifdef _DEBUG
-                if(buffering_state_counter_ > buffering_state_length_) {
-                    BOOST_LOG_TRIVIAL(debug) << "Left buffering state";
-                }
+        if(buffering_state_counter_ > buffering_state_length_) {
+            BOOST_LOG_TRIVIAL(debug) << "Left buffering state";
+        }
 #endif
+    }
+    else
+    {
+        // give bittorrent critical_window_timeout_ ms before falling back
+        disp_->post_delayed(
+            boost::bind(&download_control_worker::fetch_window_pieces, this, 
+                        windows,
+                        force_request),
+            critical_window_timeout_);
+    }
+}
+
+void download_control_worker::fetch_window_pieces(const std::vector<piece_range>& windows, 
+                                                  bool force_request)
+{
+    /* The cursors may have moved or been removed since this was posted, 
+     * and the requests for their old windows may have been cancelled. 
+     * Only the pieces that are still in a window are requested.
+     */
+    std::vector<piece_range> ranges;
+    std::vector<piece_range>::const_iterator it;
+    for(it = windows.begin(); it != windows.end(); ++it) {
+        int first = it->first;
+        while(first < it->second) {
+            while(first < it->second && !in_cursor_window(first)) {
+                ++first;
             }
-        }
-        else
-        {
-            disp_->post_delayed(
-                boost::bind(&download_control_worker::fetch_missing_pieces, this, 
-                            dev, 
-                            first_piece_to_prioritize, 
-                            first_piece_to_prioritize + num_pieces_in_critical_window - 1,
-                            force_request,
-                            _1));
+            int end = first;
+            while(end < it->second && in_cursor_window(end)) {
+                ++end;
+            }
+            if(end > first) {
+                ranges.push_back(piece_range(first, end));
+            }
+            first = end;
         }
     }
+
+    if(!ranges.empty()) {
+        fetch_missing_pieces(ranges, force_request);
+    }
 }
 
-void download_control_worker::fetch_missing_pieces(download_device* dev, 
-                                                   int first_piece, 
-                                                   int last_piece,
-                                                   bool force_request,
-                                                   boost::system::error_code& error)
+void download_control_worker::fetch_missing_pieces(const std::vector<piece_range>& ranges, 
+                                                   bool force_request)
 {
-    assert(last_piece >= first_piece);
-    
-    libtorrent::torrent_status status = torrent_handle_.status();
-    libtorrent::bitfield pieces = status.pieces;
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    expire_requests(now);
 
-    assert(last_piece < pieces.size());
+    const libtorrent::torrent_info& torrent_info = torrent_handle_.get_torrent_info();
+
+    int max_length = 0;
+    std::vector<piece_range>::const_iterator range_it;
+    for(range_it = ranges.begin(); range_it != ranges.end(); ++range_it) {
+        assert(range_it->second <= availability_.num_pieces());
+        if(range_it->second > range_it->first) {
+            hedge_late_requests(range_it->first, range_it->second - 1, now);
+            max_length = std::max(max_length, range_it->second - range_it->first);
+        }
+    }
 
     std::vector<libcow::piece_request> reqs;
+    // only used for forced requests, when the ranges overlap
+    std::set<int> requested;
 
+    // the pieces closest to each playback position are requested first
+    for(int distance = 0; distance < max_length; ++distance) {
+        for(range_it = ranges.begin(); range_it != ranges.end(); ++range_it) {
+            int i = range_it->first + distance;
+            if(i >= range_it->second) {
+                continue;
+            }
+            /* Request only pieces that we don't already have or 
+             * haven't alread requested. Always request already 
+             * requested pieces if force_request is set to true 
+             * (but never request pieces that we already have).
+             */
+            if(!availability_.has_piece(i) && (force_request || !piece_states_.is_requested(i)) &&
+               requested.insert(i).second) 
+            {
+                reqs.push_back(piece_request(torrent_info.piece_length(), i, 1));
+                piece_states_.set_requested(i, true);
+                BOOST_LOG_TRIVIAL(debug) 
+                    << "Falling back to random access download devices for piece " << i
+                    << (force_request ? " (forced request)" : "");
+            }
+        }
+    }
+
+    if(reqs.empty()) {
+        return;
+    }
+
+    // split the requests over the devices that are expected to deliver them first
+    std::vector<request_stripe> stripes;
+    stripe_requests(reqs, stripes, -1);
+
+    std::vector<request_stripe>::iterator it;
+    for(it = stripes.begin(); it != stripes.end(); ++it) {
+        send_requests(it->first, it->second, now, false);
+    }
+}
+
+void download_control_worker::send_requests(download_device* dev,
+                                            const std::vector<libcow::piece_request>& reqs,
+                                            const boost::posix_time::ptime& now,
+                                            bool hedge)
+{
     const libtorrent::torrent_info& torrent_info = torrent_handle_.get_torrent_info();
 
-    for(int i = first_piece; i <= last_piece; ++i) {
-        // don't request non-existing pieces
-        if(i >= torrent_info.num_pieces()) {
-            break;
-        }
-        /* Request only pieces that we don't already have or 
-         * haven't alread requested. Always request already 
-         * requested pieces if force_request is set to true 
-         * (but never request pieces that we already have).
-         */
-        if(!pieces[i] && (force_request || !critically_requested_[i])) {
-            reqs.push_back(piece_request(torrent_info.piece_length(), i, 1));
-            critically_requested_[i] = true;
-            BOOST_LOG_TRIVIAL(debug) 
-                << "Falling back to random access download devices for piece " << i
-                << (force_request ? " (forced request)" : "");
+    size_t bytes = 0;
+    std::vector<libcow::piece_request>::const_iterator it;
+    for(it = reqs.begin(); it != reqs.end(); ++it) {
+        bytes += torrent_info.piece_size(it->index);
+    }
+
+    boost::shared_ptr<request_batch> batch(new request_batch(dev->id(), now, bytes, reqs.size()));
+    typedef std::multimap<int, boost::shared_ptr<request_batch> >::iterator request_iterator;
+    for(it = reqs.begin(); it != reqs.end(); ++it) {
+        // a forced request replaces the earlier requests for the same piece,
+        // while a hedged request races the one that is late
+        if(!hedge) {
+            std::pair<request_iterator, request_iterator> range = 
+                outstanding_requests_.equal_range(it->index);
+            for(request_iterator req_it = range.first; req_it != range.second; ) {
+                drop_request(req_it++);
+            }
         }
+        outstanding_requests_.insert(std::make_pair(it->index, batch));
     }
+    device_stats_[dev->id()].request_sent(bytes);
+
+    // the bookkeeping is per piece, but the device gets the runs of pieces
+    std::vector<libcow::piece_request> ranged_reqs;
+    coalesce_piece_requests(reqs, ranged_reqs);
 
-    if(reqs.size() > 0) {
-        dev->get_pieces(reqs);
+    if(!dev->get_pieces(ranged_reqs)) {
+        BOOST_LOG_TRIVIAL(warning) << "download_control_worker: device " << dev->id()
+                                   << " refused the request";
+        for(it = reqs.begin(); it != reqs.end(); ++it) {
+            std::pair<request_iterator, request_iterator> range = 
+                outstanding_requests_.equal_range(it->index);
+            for(request_iterator req_it = range.first; req_it != range.second; ) {
+                if(req_it->second == batch) {
+                    outstanding_requests_.erase(req_it++);
+                } else {
+                    ++req_it;
+                }
+            }
+            if(outstanding_requests_.count(it->index) == 0) {
+                piece_states_.set_requested(it->index, false);
+            }
+        }
+        device_stats_[dev->id()].request_failed(bytes);
     }
 }
 
@@ -283,3 +1171,161 @@ void download_control_worker::handle_set_buffering_state()
     BOOST_LOG_TRIVIAL(debug) << "Entered buffering state";
     buffering_state_counter_ = 0;
 }
+
+void download_control_worker::set_readahead_handler(const readahead_handler& handler)
+{
+    disp_->post(boost::bind(
+        &download_control_worker::handle_set_readahead_handler, this, handler));
+}
+
+void download_control_worker::handle_set_readahead_handler(const readahead_handler& handler)
+{
+    readahead_handler_ = handler;
+}
+
+void download_control_worker::update_readahead(size_t offset)
+{
+    if(!readahead_handler_) {
+        return;
+    }
+
+    const libtorrent::torrent_info& torrent_info = torrent_handle_.get_torrent_info();
+    size_t piece_size = torrent_info.piece_length();
+    int first_piece = offset / piece_size;
+    if(first_piece >= torrent_info.num_pieces()) {
+        return;
+    }
+
+    int window_pieces = critical_window_bytes() / piece_size + 1;
+    int readahead_pieces = readahead_windows_ * window_pieces;
+
+    // keep one critical window behind the playback position for small rewinds
+    size_t played_end = first_piece > window_pieces ? (first_piece - window_pieces) * piece_size : 0;
+
+    // after a seek, start over from the new position without dropping 
+    // the data that was skipped, it has never been read
+    if(readahead_piece_ < 0 || first_piece < readahead_piece_ || 
+       first_piece > readahead_piece_ + readahead_pieces) 
+    {
+        will_need_end_ = first_piece * piece_size;
+        dont_need_end_ = played_end;
+    }
+    readahead_piece_ = first_piece;
+
+    // only pieces that have been downloaded can be read ahead
+    int last_piece = std::min(availability_.next_missing_piece(first_piece), 
+                              first_piece + readahead_pieces);
+    size_t will_need_end = last_piece * piece_size;
+    if(will_need_end > will_need_end_) {
+        readahead_handler_(will_need_end_, will_need_end - will_need_end_, file_reader::will_need);
+        will_need_end_ = will_need_end;
+    }
+
+    if(played_end > dont_need_end_) {
+        readahead_handler_(dont_need_end_, played_end - dont_need_end_, file_reader::dont_need);
+        dont_need_end_ = played_end;
+    }
+}
+
+void download_control_worker::set_seek_history_file(const std::string& path)
+{
+    disp_->post(boost::bind(
+        &download_control_worker::handle_set_seek_history_file, this, path));
+}
+
+void download_control_worker::handle_set_seek_history_file(const std::string& path)
+{
+    if(!prefetcher_.load(path)) {
+        BOOST_LOG_TRIVIAL(debug) << "download_control_worker: no seek history in " << path;
+    }
+    seek_history_path_ = path;
+}
+
+bool download_control_worker::is_seek(const playback_cursor& cursor, 
+                                      size_t offset, 
+                                      const boost::posix_time::ptime& now)
+{
+    if(offset < cursor.offset) {
+        // anything more than a piece back is a rewind
+        return cursor.offset - offset > static_cast<size_t>(torrent_handle_.get_torrent_info().piece_length());
+    }
+
+    // the playback moves forward by itself, depending on how long ago the cursor was moved
+    double elapsed = cursor.updated.is_not_a_date_time() ? 0.0 : seconds(now - cursor.updated);
+    size_t max_distance = std::max(min_seek_distance, 
+                                   static_cast<size_t>(4 * bitrate_ * elapsed));
+    return offset - cursor.offset > max_distance;
+}
+
+void download_control_worker::prefetch_seek_targets()
+{
+    if(availability_.is_complete()) {
+        return;
+    }
+
+    // only use the bandwidth that the playback positions don't need
+    bool idle = outstanding_requests_.empty();
+    std::map<std::string, playback_cursor>::iterator cursor_it;
+    for(cursor_it = cursors_.begin(); idle && cursor_it != cursors_.end(); ++cursor_it) {
+        const playback_cursor& cursor = cursor_it->second;
+        int end_piece = std::min(cursor.first_piece + cursor.num_window_pieces, 
+                                 availability_.num_pieces());
+        if(!availability_.has_pieces(cursor.first_piece, end_piece - 1)) {
+            idle = false;
+        }
+    }
+
+    std::vector<size_t> targets;
+    if(idle) {
+        prefetcher_.likely_targets(max_prefetch_targets, targets);
+    }
+    if(targets.empty() && prefetch_ranges_.empty()) {
+        return;
+    }
+
+    /* The pieces after each target are prefetched like a pre_buffer, but
+     * at a priority below the critical windows, and without requesting 
+     * pieces again. The priorities are worked out from the current targets
+     * on every pass, so targets that have decayed, or bandwidth that the
+     * playback needs again, take the pieces back to the normal priority.
+     */
+    const libtorrent::torrent_info& torrent_info = torrent_handle_.get_torrent_info();
+    size_t window_bytes = critical_window_bytes();
+    std::vector<piece_range> ranges;
+
+    reset_desired_priorities();
+    std::vector<piece_range>::iterator range_it;
+    for(range_it = prefetch_ranges_.begin(); range_it != prefetch_ranges_.end(); ++range_it) {
+        for(int i = range_it->first; i < range_it->second; ++i) {
+            // higher priorities belong to a critical window or a pre_buffer
+            if(desired_priorities_[i] == prefetch_priority) {
+                desired_priorities_[i] = 1;
+            }
+        }
+    }
+
+    std::vector<size_t>::iterator it;
+    for(it = targets.begin(); it != targets.end(); ++it) {
+        int first_piece = *it / torrent_info.piece_length();
+        int end_piece = std::min(static_cast<int>((*it + window_bytes) / torrent_info.piece_length()) + 1,
+                                 torrent_info.num_pieces());
+        if(first_piece >= end_piece || 
+           in_cursor_window(first_piece) || 
+           availability_.has_pieces(first_piece, end_piece - 1)) 
+        {
+            continue;
+        }
+        for(int i = first_piece; i < end_piece; ++i) {
+            desired_priorities_[i] = std::max(desired_priorities_[i], prefetch_priority);
+        }
+        ranges.push_back(piece_range(first_piece, end_piece));
+    }
+    apply_desired_priorities();
+    prefetch_ranges_ = ranges;
+
+    if(!ranges.empty() && has_random_access_device()) {
+        BOOST_LOG_TRIVIAL(debug) << "download_control_worker: prefetching " 
+                                 << ranges.size() << " likely seek targets";
+        fetch_missing_pieces(ranges, false);
+    }
+}
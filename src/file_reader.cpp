@@ -0,0 +1,225 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include "cow/libcow_def.hpp"
+#include "cow/file_reader.hpp"
+
+#include <boost/log/trivial.hpp>
+
+#include <algorithm>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#endif
+
+using namespace libcow;
+
+#ifdef WIN32
+
+file_reader::file_reader()
+    : handle_(INVALID_HANDLE_VALUE)
+{
+
+}
+
+bool file_reader::open(const std::string& path)
+{
+    close();
+    handle_ = CreateFileA(path.c_str(), 
+                          GENERIC_READ, 
+                          FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                          NULL,
+                          OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL,
+                          NULL);
+    return handle_ != INVALID_HANDLE_VALUE;
+}
+
+void file_reader::close()
+{
+    if(handle_ != INVALID_HANDLE_VALUE) {
+        CloseHandle(handle_);
+        handle_ = INVALID_HANDLE_VALUE;
+    }
+}
+
+bool file_reader::is_open() const
+{
+    return handle_ != INVALID_HANDLE_VALUE;
+}
+
+size_t file_reader::read(size_t offset, char* dest, size_t length) const
+{
+    size_t bytes_read = 0;
+    while(bytes_read < length) {
+        // ReadFile with an OVERLAPPED offset doesn't depend on the file pointer
+        OVERLAPPED overlapped = {0};
+        ULONGLONG pos = static_cast<ULONGLONG>(offset + bytes_read);
+        overlapped.Offset = static_cast<DWORD>(pos & 0xffffffff);
+        overlapped.OffsetHigh = static_cast<DWORD>(pos >> 32);
+
+        DWORD count = 0;
+        DWORD to_read = static_cast<DWORD>(std::min<size_t>(length - bytes_read, 0x40000000));
+        if(!ReadFile(handle_, dest + bytes_read, to_read, &count, &overlapped) || count == 0) {
+            break;
+        }
+        bytes_read += count;
+    }
+    return bytes_read;
+}
+
+size_t file_reader::read(size_t offset, const std::vector<libcow::utils::buffer>& buffers) const
+{
+    size_t bytes_read = 0;
+    std::vector<libcow::utils::buffer>::const_iterator it;
+    for(it = buffers.begin(); it != buffers.end(); ++it) {
+        libcow::utils::buffer buffer = *it;
+        size_t count = read(offset + bytes_read, buffer.data(), buffer.size());
+        bytes_read += count;
+        if(count < buffer.size()) {
+            break;
+        }
+    }
+    return bytes_read;
+}
+
+void file_reader::advise(size_t offset, size_t length, access_hint hint) const
+{
+    // windows has no equivalent for an already opened file
+}
+
+#else
+
+file_reader::file_reader()
+    : fd_(-1)
+{
+
+}
+
+bool file_reader::open(const std::string& path)
+{
+    close();
+    fd_ = ::open(path.c_str(), O_RDONLY);
+    return fd_ >= 0;
+}
+
+void file_reader::close()
+{
+    if(fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+bool file_reader::is_open() const
+{
+    return fd_ >= 0;
+}
+
+size_t file_reader::read(size_t offset, char* dest, size_t length) const
+{
+    size_t bytes_read = 0;
+    while(bytes_read < length) {
+        ssize_t count = ::pread(fd_, dest + bytes_read, length - bytes_read, offset + bytes_read);
+        if(count < 0 && errno == EINTR) {
+            continue;
+        } 
+        if(count <= 0) {
+            if(count < 0) {
+                BOOST_LOG_TRIVIAL(warning) << "file_reader::read: pread failed with errno " << errno;
+            }
+            break;
+        }
+        bytes_read += count;
+    }
+    return bytes_read;
+}
+
+size_t file_reader::read(size_t offset, const std::vector<libcow::utils::buffer>& buffers) const
+{
+    std::vector<struct iovec> iov(buffers.size());
+    size_t length = 0;
+    for(size_t i = 0; i < buffers.size(); ++i) {
+        libcow::utils::buffer buffer = buffers[i];
+        iov[i].iov_base = buffer.data();
+        iov[i].iov_len = buffer.size();
+        length += buffer.size();
+    }
+
+    size_t bytes_read = 0;
+    size_t first = 0;
+    while(bytes_read < length && first < iov.size()) {
+        int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+        ssize_t result = ::preadv(fd_, &iov[first], count, offset + bytes_read);
+        if(result < 0 && errno == EINTR) {
+            continue;
+        }
+        if(result <= 0) {
+            if(result < 0) {
+                BOOST_LOG_TRIVIAL(warning) << "file_reader::read: preadv failed with errno " << errno;
+            }
+            break;
+        }
+        bytes_read += result;
+
+        // skip the buffers that were filled and adjust a partially filled one
+        size_t remaining = result;
+        while(first < iov.size() && remaining >= iov[first].iov_len) {
+            remaining -= iov[first].iov_len;
+            ++first;
+        }
+        if(remaining > 0) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + remaining;
+            iov[first].iov_len -= remaining;
+        }
+    }
+    return bytes_read;
+}
+
+void file_reader::advise(size_t offset, size_t length, access_hint hint) const
+{
+#ifdef POSIX_FADV_WILLNEED
+    int advice = (hint == will_need) ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED;
+    int error = ::posix_fadvise(fd_, offset, length, advice);
+    if(error != 0) {
+        BOOST_LOG_TRIVIAL(debug) << "file_reader::advise: posix_fadvise failed with error " << error;
+    }
+#endif
+}
+
+#endif
+
+file_reader::~file_reader()
+{
+    close();
+}
@@ -0,0 +1,464 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include "cow/libcow_def.hpp"
+#include "cow/http_stream_server.hpp"
+#include "cow/exceptions.hpp"
+
+#include <boost/bind.hpp>
+#include <boost/log/trivial.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#endif
+
+using namespace libcow;
+using boost::asio::ip::tcp;
+
+// the number of bytes to send in each step of a response body
+static const size_t send_chunk_size = 256 * 1024;
+// the time in ms to wait for data before checking if the server is stopping
+static const int read_timeout = 500;
+// the number of bytes sent between two updates of the playback position,
+// each update makes the download_control rerun its download strategy
+static const size_t position_update_interval = 4 * send_chunk_size;
+
+namespace {
+    enum range_result {
+        no_range,
+        valid_range,
+        unsatisfiable_range
+    };
+
+    /* Parses the value of a Range header. Only a single byte range is
+     * supported, anything else is ignored and the whole resource is sent,
+     * which is what RFC 2616 allows a server to do.
+     */
+    range_result parse_range(const std::string& value, size_t size, size_t& first, size_t& last)
+    {
+        const std::string unit = "bytes=";
+        if(value.compare(0, unit.size(), unit) != 0 || value.find(',') != std::string::npos) {
+            return no_range;
+        }
+
+        std::string spec = value.substr(unit.size());
+        std::string::size_type dash = spec.find('-');
+        if(dash == std::string::npos) {
+            return no_range;
+        }
+        std::string first_str = spec.substr(0, dash);
+        std::string last_str = spec.substr(dash + 1);
+        if(first_str.find_first_not_of("0123456789") != std::string::npos ||
+           last_str.find_first_not_of("0123456789") != std::string::npos ||
+           (first_str.empty() && last_str.empty()))
+        {
+            return no_range;
+        }
+
+        if(first_str.empty()) {
+            // the last suffix_length bytes
+            size_t suffix_length = strtoul(last_str.c_str(), NULL, 10);
+            if(suffix_length == 0 || size == 0) {
+                return unsatisfiable_range;
+            }
+            first = size - std::min(suffix_length, size);
+            last = size - 1;
+            return valid_range;
+        }
+
+        first = strtoul(first_str.c_str(), NULL, 10);
+        last = last_str.empty() ? size - 1 : strtoul(last_str.c_str(), NULL, 10);
+        if(!last_str.empty() && last < first) {
+            return no_range;
+        }
+        if(first >= size) {
+            return unsatisfiable_range;
+        }
+        last = std::min(last, size - 1);
+        return valid_range;
+    }
+
+    std::string trim(const std::string& str)
+    {
+        std::string::size_type begin = str.find_first_not_of(" \t\r");
+        if(begin == std::string::npos) {
+            return std::string();
+        }
+        std::string::size_type end = str.find_last_not_of(" \t\r");
+        return str.substr(begin, end - begin + 1);
+    }
+
+    /* Peeks at the socket without blocking. A client that has closed the
+     * connection shows up as end of file, or as an error.
+     */
+    bool client_connected(tcp::socket& socket)
+    {
+        char byte;
+        boost::system::error_code error;
+        socket.non_blocking(true, error);
+        if(!error) {
+            socket.receive(boost::asio::buffer(&byte, 1), tcp::socket::message_peek, error);
+        }
+        boost::system::error_code ignored;
+        socket.non_blocking(false, ignored);
+        return !error || error == boost::asio::error::would_block;
+    }
+
+    std::string to_lower(std::string str)
+    {
+        for(std::string::iterator it = str.begin(); it != str.end(); ++it) {
+            *it = static_cast<char>(tolower(*it));
+        }
+        return str;
+    }
+}
+
+http_stream_server::http_stream_server(download_control& ctrl, const std::string& content_type)
+    : control_source_(new download_control_stream_source(ctrl)),
+      source_(*control_source_),
+      content_type_(content_type),
+      acceptor_(io_service_),
+      port_(0),
+      running_(false)
+{
+
+}
+
+http_stream_server::http_stream_server(stream_source& source, const std::string& content_type)
+    : source_(source),
+      content_type_(content_type),
+      acceptor_(io_service_),
+      port_(0),
+      running_(false)
+{
+
+}
+
+http_stream_server::~http_stream_server()
+{
+    stop();
+}
+
+unsigned short http_stream_server::start(unsigned short port, const std::string& address)
+{
+    if(running_) {
+        return port_;
+    }
+
+    try {
+        tcp::endpoint endpoint(boost::asio::ip::address::from_string(address), port);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(tcp::acceptor::reuse_address(true));
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
+        port_ = acceptor_.local_endpoint().port();
+    } catch(boost::system::system_error& e) {
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+        std::stringstream ss;
+        ss << "http_stream_server: could not listen on " << address << ":" << port 
+           << ": " << e.what();
+        throw libcow::exception(ss.str());
+    }
+
+    running_ = true;
+    start_accept();
+    io_service_.reset();
+    accept_thread_ = boost::thread(boost::bind(&boost::asio::io_service::run, &io_service_));
+
+    BOOST_LOG_TRIVIAL(info) << "http_stream_server: listening on " << address << ":" << port_;
+    return port_;
+}
+
+void http_stream_server::stop()
+{
+    if(!running_.exchange(false)) {
+        return;
+    }
+
+    // the acceptor belongs to the accept thread
+    io_service_.post(boost::bind(&http_stream_server::close_acceptor, this));
+    accept_thread_.join();
+
+    {
+        // wake up connection threads that are blocked reading from their sockets
+        boost::lock_guard<boost::mutex> lock(sockets_mutex_);
+        std::list<socket_ptr>::iterator it;
+        for(it = sockets_.begin(); it != sockets_.end(); ++it) {
+            boost::system::error_code ignored;
+            (*it)->shutdown(tcp::socket::shutdown_both, ignored);
+        }
+    }
+    // no new connections are accepted once the accept thread has exited
+    std::list<thread_ptr>::iterator it;
+    for(it = connection_threads_.begin(); it != connection_threads_.end(); ++it) {
+        (*it)->join();
+    }
+    connection_threads_.clear();
+}
+
+void http_stream_server::close_acceptor()
+{
+    boost::system::error_code ignored;
+    acceptor_.close(ignored);
+}
+
+void http_stream_server::start_accept()
+{
+    socket_ptr socket(new tcp::socket(io_service_));
+    acceptor_.async_accept(*socket, boost::bind(&http_stream_server::handle_accept, this, 
+                                                socket, boost::asio::placeholders::error));
+}
+
+void http_stream_server::handle_accept(socket_ptr socket, const boost::system::error_code& error)
+{
+    if(!running_) {
+        return;
+    }
+    if(error) {
+        BOOST_LOG_TRIVIAL(warning) << "http_stream_server: accept failed: " << error.message();
+    } else {
+        reap_connection_threads();
+        boost::lock_guard<boost::mutex> lock(sockets_mutex_);
+        sockets_.push_back(socket);
+        connection_threads_.push_back(thread_ptr(
+            new boost::thread(boost::bind(&http_stream_server::serve, this, socket))));
+    }
+    start_accept();
+}
+
+void http_stream_server::reap_connection_threads()
+{
+    // connection_threads_ is only used by the accept thread, and by stop
+    // once the accept thread has exited
+    std::list<thread_ptr>::iterator it = connection_threads_.begin();
+    while(it != connection_threads_.end()) {
+        if((*it)->timed_join(boost::posix_time::seconds(0))) {
+            it = connection_threads_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void http_stream_server::serve(socket_ptr socket)
+{
+#ifdef __linux__
+    /* Unlike the asio writes, sendfile can't be told not to raise SIGPIPE
+     * when the client has gone away. Block it in this thread, the error is
+     * still reported by sendfile.
+     */
+    sigset_t sigpipe;
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+#endif
+
+    boost::asio::streambuf request_buf;
+    while(running_ && handle_request(*socket, request_buf)) {
+        // keep the connection alive
+    }
+
+    boost::system::error_code ignored;
+    socket->shutdown(tcp::socket::shutdown_both, ignored);
+
+    boost::lock_guard<boost::mutex> lock(sockets_mutex_);
+    socket->close(ignored);
+    sockets_.remove(socket);
+}
+
+bool http_stream_server::handle_request(tcp::socket& socket, boost::asio::streambuf& request_buf)
+{
+    boost::system::error_code error;
+    boost::asio::read_until(socket, request_buf, "\r\n\r\n", error);
+    if(error) {
+        return false;
+    }
+
+    std::istream request(&request_buf);
+    std::string line;
+    std::getline(request, line);
+
+    std::string method;
+    std::string target;
+    std::string version;
+    std::istringstream request_line(line);
+    request_line >> method >> target >> version;
+
+    std::string range;
+    std::string connection;
+    while(std::getline(request, line) && line != "\r" && !line.empty()) {
+        std::string::size_type colon = line.find(':');
+        if(colon == std::string::npos) {
+            continue;
+        }
+        std::string name = to_lower(trim(line.substr(0, colon)));
+        if(name == "range") {
+            range = trim(line.substr(colon + 1));
+        } else if(name == "connection") {
+            connection = to_lower(trim(line.substr(colon + 1)));
+        }
+    }
+
+    if(version.compare(0, 5, "HTTP/") != 0) {
+        send_response(socket, "400 Bad Request", "Content-Length: 0\r\nConnection: close\r\n");
+        return false;
+    }
+    if(method != "GET" && method != "HEAD") {
+        send_response(socket, "405 Method Not Allowed", 
+                      "Allow: GET, HEAD\r\nContent-Length: 0\r\nConnection: close\r\n");
+        return false;
+    }
+
+    bool keep_alive = (version == "HTTP/1.0") ? connection == "keep-alive" : connection != "close";
+
+    size_t size = source_.size();
+    size_t first = 0;
+    size_t last = size - 1;
+    range_result result = range.empty() ? no_range : parse_range(range, size, first, last);
+
+    std::stringstream headers;
+    headers << "Accept-Ranges: bytes\r\n"
+            << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n";
+
+    if(result == unsatisfiable_range) {
+        headers << "Content-Range: bytes */" << size << "\r\n"
+                << "Content-Length: 0\r\n";
+        return send_response(socket, "416 Requested Range Not Satisfiable", headers.str()) && keep_alive;
+    }
+
+    if(result == no_range) {
+        first = 0;
+        last = size - 1;
+    }
+    size_t length = size > 0 ? last - first + 1 : 0;
+
+    headers << "Content-Type: " << content_type_ << "\r\n"
+            << "Content-Length: " << length << "\r\n";
+    if(result == valid_range) {
+        headers << "Content-Range: bytes " << first << "-" << last << "/" << size << "\r\n";
+    }
+
+    if(!send_response(socket, result == valid_range ? "206 Partial Content" : "200 OK", headers.str())) {
+        return false;
+    }
+    if(method == "HEAD" || length == 0) {
+        return keep_alive;
+    }
+    return send_body(socket, first, first + length) && keep_alive;
+}
+
+bool http_stream_server::send_response(tcp::socket& socket, 
+                                       const std::string& status,
+                                       const std::string& headers)
+{
+    std::string response = "HTTP/1.1 " + status + "\r\n" + headers + "\r\n";
+    boost::system::error_code error;
+    boost::asio::write(socket, boost::asio::buffer(response), error);
+    return !error;
+}
+
+bool http_stream_server::send_body(tcp::socket& socket, size_t first, size_t end)
+{
+    std::vector<char> data(send_chunk_size);
+    size_t pos = first;
+
+#ifdef __linux__
+    int file = -1;
+    bool use_sendfile = true;
+#endif
+
+    source_.set_playback_position(pos);
+    size_t next_position_update = pos + position_update_interval;
+
+    bool ok = true;
+    while(ok && pos < end) {
+        if(!running_) {
+            ok = false;
+            break;
+        }
+        if(pos >= next_position_update) {
+            source_.set_playback_position(pos);
+            next_position_update = pos + position_update_interval;
+        }
+        size_t count = std::min(end - pos, send_chunk_size);
+
+#ifdef __linux__
+        // downloaded data goes straight from the page cache to the socket
+        size_t on_disk = use_sendfile ? source_.bytes_on_disk(pos) : 0;
+        if(on_disk > 0) {
+            if(file < 0) {
+                file = ::open(source_.filename().c_str(), O_RDONLY);
+            }
+            off_t offset = pos;
+            ssize_t sent = file < 0 ? -1 : 
+                ::sendfile(socket.native_handle(), file, &offset, std::min(count, on_disk));
+            if(sent > 0) {
+                pos += sent;
+                continue;
+            }
+            if(sent < 0 && errno == EINTR) {
+                continue;
+            }
+            // fall back to copying the data for the rest of this response
+            BOOST_LOG_TRIVIAL(debug) << "http_stream_server: sendfile failed, copying data instead";
+            use_sendfile = false;
+        }
+#endif
+
+        libcow::utils::buffer buffer(&data[0], count);
+        size_t bytes = source_.read(pos, buffer, read_timeout);
+        if(bytes == 0) {
+            // not downloaded yet, stop waiting if the client went away
+            ok = client_connected(socket);
+            continue;
+        }
+
+        boost::system::error_code error;
+        boost::asio::write(socket, boost::asio::buffer(&data[0], bytes), error);
+        ok = !error;
+        pos += bytes;
+    }
+
+#ifdef __linux__
+    if(file >= 0) {
+        ::close(file);
+    }
+#endif
+    return ok;
+}
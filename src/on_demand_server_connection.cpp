@@ -34,6 +34,7 @@ either expressed or implied, of CowboyCoders.
 
 #include <boost/log/trivial.hpp>
 
+#include <algorithm>
 #include <iterator>
 #include <sstream>
 
@@ -44,6 +45,7 @@ on_demand_server_connection::on_demand_server_connection() :
         is_random_access_(true),
         is_stream_(false),
         is_readable_(true),
+        range_requests_(false),
         work(io_service),
         id_(0)
 {
@@ -87,6 +89,8 @@ bool on_demand_server_connection::open(const int id, std::string type, const pro
         } else if(it->first.compare("max_simultaneous_downloads") == 0) {
             std::istringstream buffer(it->second);
             buffer >> max_simultaneous_downloads;
+        } else if(it->first.compare("range_requests") == 0) {
+            range_requests_ = it->second == "true" || it->second == "1";
         }
     }
     if(address == "" ||
@@ -138,22 +142,69 @@ bool on_demand_server_connection::close()
 
 void on_demand_server_connection::send(size_t piece_size, std::vector<int> indices)
 {
+    boost::shared_ptr<pending_request> request(new pending_request(indices));
+    {
+        boost::mutex::scoped_lock lock(pending_mutex_);
+        pending_requests_.push_back(request);
+    }
+
     io_service.post(
             boost::bind(&on_demand_server_connection::worker,
                         this,
                         connection_string_,
                         piece_size,
-                        indices));
+                        request));
     
 }
 
+void on_demand_server_connection::cancel_pieces(const std::vector<int>& piece_indices)
+{
+    boost::mutex::scoped_lock lock(pending_mutex_);
+
+    std::list<boost::shared_ptr<pending_request> >::iterator it;
+    for(it = pending_requests_.begin(); it != pending_requests_.end(); ++it) {
+        pending_request& request = **it;
+        for(size_t i = 0; i < request.indices.size(); ++i) {
+            if(!request.cancelled[i] && 
+               std::find(piece_indices.begin(), piece_indices.end(), request.indices[i]) != piece_indices.end()) 
+            {
+                request.cancelled[i] = true;
+                ++request.num_cancelled;
+            }
+        }
+    }
+}
+
+bool on_demand_server_connection::is_cancelled(boost::shared_ptr<pending_request> request)
+{
+    boost::mutex::scoped_lock lock(pending_mutex_);
+    return request->num_cancelled == request->indices.size();
+}
 
 void on_demand_server_connection::worker(std::string connection_str,
                                          const std::size_t piece_size,
-                                         const std::vector<int>& indices)
+                                         boost::shared_ptr<pending_request> request)
+{
+    if(is_cancelled(request)) {
+        BOOST_LOG_TRIVIAL(debug) << "on_demand_server_connection::worker: dropping cancelled request";
+    } else {
+        perform_request(connection_str, piece_size, request);
+    }
+
+    boost::mutex::scoped_lock lock(pending_mutex_);
+    pending_requests_.remove(request);
+}
+
+void on_demand_server_connection::perform_request(std::string connection_str,
+                                                  const std::size_t piece_size,
+                                                  boost::shared_ptr<pending_request> request)
 {
-     
+    const std::vector<int>& indices = request->indices;
+
     curl_instance curl(connection_str);
+    // transfers that are no longer needed, e.g. after a seek, are aborted
+    curl.set_abort_function(
+        boost::bind(&on_demand_server_connection::is_cancelled, this, request));
 
     std::stringstream size_str;
     size_str << "Size: " << piece_size;
@@ -178,7 +229,10 @@ void on_demand_server_connection::worker(std::string connection_str,
     headers.push_back(index_str.str());
 
     try {
-        utils::buffer buf = curl.perform_bounded_request(60,headers,piece_size*indices.size());
+        // the indices of a range request are consecutive, see get_pieces
+        utils::buffer buf = range_requests_ ? 
+            curl.perform_range_request(60, piece_size*indices.front(), piece_size*indices.size()) :
+            curl.perform_bounded_request(60,headers,piece_size*indices.size());
         
         // these are the pointers we will actually pass to the user
         std::vector<piece_data> piece_datas;
@@ -200,6 +254,11 @@ void on_demand_server_connection::worker(std::string connection_str,
             handler_(id_, piece_datas);
         }
     } catch(libcow::exception& e) {
+        if(is_cancelled(request)) {
+            BOOST_LOG_TRIVIAL(debug) << "on_demand_server_connection::worker: "
+                                     << "aborted cancelled request for indices: " << index_str.str();
+            return;
+        }
         // unfortunately, we can't do much here
         // everything is asynchronous, so there's no way 
         // to get the exception back to the original caller
@@ -258,9 +317,16 @@ bool on_demand_server_connection::get_pieces(const std::vector<piece_request> &
             {
                 indices.push_back(req.index+i);
             }
+            // each run of pieces is a transfer of its own
+            if(range_requests_) {
+                send(req.piece_size, indices);
+                indices.clear();
+            }
         }
 
-        send(requests[0].piece_size, indices);
+        if(!indices.empty()) {
+            send(requests[0].piece_size, indices);
+        }
         return true;
     }
 }
@@ -0,0 +1,179 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include "cow/libcow_def.hpp"
+#include "cow/piece_availability.hpp"
+
+#include <algorithm>
+
+using namespace libcow;
+
+piece_availability::piece_availability(int num_pieces)
+    : num_pieces_(num_pieces),
+      num_available_(0),
+      num_leaves_(1)
+{
+    while(num_leaves_ < num_pieces_) {
+        num_leaves_ *= 2;
+    }
+    tree_.reset(new boost::atomic<unsigned char>[2 * num_leaves_]);
+    for(int node = 0; node < 2 * num_leaves_; ++node) {
+        tree_[node].store(0, boost::memory_order_relaxed);
+    }
+}
+
+void piece_availability::reset(const libtorrent::bitfield& pieces)
+{
+    int num_available = 0;
+    for(int i = 0; i < num_pieces_; ++i) {
+        bool have = i < pieces.size() && pieces[i];
+        tree_[num_leaves_ + i].store(have ? 1 : 0, boost::memory_order_release);
+        if(have) {
+            ++num_available;
+        }
+    }
+    update_inner_nodes();
+    num_available_.store(num_available, boost::memory_order_release);
+}
+
+void piece_availability::set_all()
+{
+    for(int i = 0; i < num_pieces_; ++i) {
+        tree_[num_leaves_ + i].store(1, boost::memory_order_release);
+    }
+    update_inner_nodes();
+    num_available_.store(num_pieces_, boost::memory_order_release);
+}
+
+void piece_availability::set_piece(int piece_index, bool have)
+{
+    if(piece_index < 0 || piece_index >= num_pieces_) {
+        return;
+    }
+    int node = num_leaves_ + piece_index;
+    if((tree_[node].load(boost::memory_order_relaxed) != 0) == have) {
+        return;
+    }
+    if(have) {
+        // the leaf goes first, so a reader never sees a parent that claims
+        // more than the leaves below it
+        tree_[node].store(1, boost::memory_order_release);
+        update_parents(node);
+        num_available_.fetch_add(1, boost::memory_order_release);
+    } else {
+        // the other way around when a piece is lost
+        num_available_.fetch_sub(1, boost::memory_order_release);
+        tree_[node].store(0, boost::memory_order_relaxed);
+        update_parents(node);
+    }
+}
+
+void piece_availability::update_parents(int node)
+{
+    // only the writer thread modifies the tree, so relaxed loads suffice here
+    for(node /= 2; node > 0; node /= 2) {
+        unsigned char full = tree_[2 * node].load(boost::memory_order_relaxed) & 
+                             tree_[2 * node + 1].load(boost::memory_order_relaxed);
+        if(tree_[node].load(boost::memory_order_relaxed) == full) {
+            break;
+        }
+        tree_[node].store(full, boost::memory_order_release);
+    }
+}
+
+void piece_availability::update_inner_nodes()
+{
+    for(int node = num_leaves_ - 1; node > 0; --node) {
+        unsigned char full = tree_[2 * node].load(boost::memory_order_relaxed) & 
+                             tree_[2 * node + 1].load(boost::memory_order_relaxed);
+        tree_[node].store(full, boost::memory_order_release);
+    }
+}
+
+bool piece_availability::has_piece(int piece_index) const
+{
+    return piece_index >= 0 && piece_index < num_pieces_ && 
+           tree_[num_leaves_ + piece_index].load(boost::memory_order_acquire);
+}
+
+bool piece_availability::has_pieces(int first_piece, int last_piece) const
+{
+    if(first_piece < 0 || last_piece >= num_pieces_) {
+        return false;
+    }
+    return find_next_missing(first_piece) > last_piece;
+}
+
+int piece_availability::next_missing_piece(int piece_index) const
+{
+    return find_next_missing(std::max(piece_index, 0));
+}
+
+int piece_availability::find_next_missing(int piece_index) const
+{
+    while(piece_index < num_pieces_) {
+        int node = num_leaves_ + piece_index;
+        if(!tree_[node].load(boost::memory_order_acquire)) {
+            return piece_index;
+        }
+
+        // climb until there is a subtree to the right with a missing piece
+        for(;;) {
+            if(node == 1) {
+                return num_pieces_;
+            }
+            if(node % 2 == 0 && !tree_[node + 1].load(boost::memory_order_acquire)) {
+                ++node;
+                break;
+            }
+            node /= 2;
+        }
+
+        // descend to the leftmost missing piece in that subtree
+        while(node < num_leaves_) {
+            node = tree_[2 * node].load(boost::memory_order_acquire) ? 2 * node + 1 : 2 * node;
+        }
+
+        // padding leaves count as missing
+        if(node - num_leaves_ >= num_pieces_ || 
+           !tree_[node].load(boost::memory_order_acquire)) 
+        {
+            return std::min(node - num_leaves_, num_pieces_);
+        }
+
+        // the writer is filling in this subtree right now, keep looking after it
+        piece_index = node - num_leaves_ + 1;
+    }
+    return num_pieces_;
+}
+
+bool piece_availability::is_complete() const
+{
+    return num_available_.load(boost::memory_order_acquire) == num_pieces_;
+}
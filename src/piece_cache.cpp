@@ -0,0 +1,109 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include "cow/libcow_def.hpp"
+#include "cow/piece_cache.hpp"
+
+#include <cstring>
+
+using namespace libcow;
+
+piece_cache::piece_cache(size_t max_pieces)
+    : max_pieces_(max_pieces)
+{
+
+}
+
+void piece_cache::set_max_pieces(size_t max_pieces)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    max_pieces_ = max_pieces;
+    evict();
+}
+
+void piece_cache::insert(int piece_index, const char* data, size_t size)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if(max_pieces_ == 0) {
+        return;
+    }
+
+    std::map<int, entry_list::iterator>::iterator it = index_.find(piece_index);
+    if(it != index_.end()) {
+        entries_.erase(it->second);
+        index_.erase(it);
+    }
+
+    entries_.push_front(entry(piece_index, std::vector<char>(data, data + size)));
+    index_[piece_index] = entries_.begin();
+    evict();
+}
+
+bool piece_cache::contains(int piece_index)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    return index_.find(piece_index) != index_.end();
+}
+
+bool piece_cache::read(int piece_index, size_t piece_offset, char* dest, size_t length)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    std::map<int, entry_list::iterator>::iterator it = index_.find(piece_index);
+    if(it == index_.end()) {
+        return false;
+    }
+
+    const std::vector<char>& data = it->second->second;
+    if(piece_offset + length > data.size()) {
+        return false;
+    }
+    memcpy(dest, &data[0] + piece_offset, length);
+
+    // mark as most recently used
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return true;
+}
+
+void piece_cache::erase(int piece_index)
+{
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    std::map<int, entry_list::iterator>::iterator it = index_.find(piece_index);
+    if(it != index_.end()) {
+        entries_.erase(it->second);
+        index_.erase(it);
+    }
+}
+
+void piece_cache::evict()
+{
+    while(entries_.size() > max_pieces_) {
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+    }
+}
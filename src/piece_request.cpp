@@ -0,0 +1,60 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include "cow/libcow_def.hpp"
+#include "cow/piece_request.hpp"
+
+#include <algorithm>
+
+using namespace libcow;
+
+void libcow::coalesce_piece_requests(const std::vector<piece_request>& reqs,
+                                     std::vector<piece_request>& ranged)
+{
+    std::vector<size_t> indices;
+    std::vector<piece_request>::const_iterator it;
+    for(it = reqs.begin(); it != reqs.end(); ++it) {
+        for(size_t i = 0; i < it->count; ++i) {
+            indices.push_back(it->index + i);
+        }
+    }
+    std::sort(indices.begin(), indices.end());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+    // only the runs added here are extended, not what ranged held before
+    size_t first_run = ranged.size();
+    std::vector<size_t>::iterator index_it;
+    for(index_it = indices.begin(); index_it != indices.end(); ++index_it) {
+        if(ranged.size() > first_run && ranged.back().index + ranged.back().count == *index_it) {
+            ++ranged.back().count;
+        } else {
+            ranged.push_back(piece_request(reqs.front().piece_size, *index_it, 1));
+        }
+    }
+}
@@ -0,0 +1,124 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include "cow/libcow_def.hpp"
+#include "cow/piece_state_table.hpp"
+
+using namespace libcow;
+
+const unsigned char piece_state_table::have_bit;
+const unsigned char piece_state_table::requested_bit;
+const unsigned char piece_state_table::added_bit;
+const unsigned char piece_state_table::origin_mask;
+const int piece_state_table::max_origin;
+
+piece_state_table::piece_state_table(int num_pieces)
+    : num_pieces_(num_pieces)
+{
+    states_.reset(new boost::atomic<unsigned char>[num_pieces_]);
+    for(int i = 0; i < num_pieces_; ++i) {
+        states_[i].store(0, boost::memory_order_relaxed);
+    }
+}
+
+void piece_state_table::reset_have(const libtorrent::bitfield& pieces)
+{
+    for(int i = 0; i < num_pieces_; ++i) {
+        set_bit(i, have_bit, i < pieces.size() && pieces[i]);
+    }
+}
+
+void piece_state_table::set_all_have()
+{
+    for(int i = 0; i < num_pieces_; ++i) {
+        states_[i].fetch_or(have_bit, boost::memory_order_release);
+    }
+}
+
+void piece_state_table::set_have(int piece_index, bool have)
+{
+    set_bit(piece_index, have_bit, have);
+}
+
+void piece_state_table::set_requested(int piece_index, bool requested)
+{
+    set_bit(piece_index, requested_bit, requested);
+}
+
+bool piece_state_table::mark_added(int piece_index)
+{
+    if(piece_index < 0 || piece_index >= num_pieces_) {
+        return false;
+    }
+    unsigned char old_state = states_[piece_index].fetch_or(added_bit, boost::memory_order_acq_rel);
+    return (old_state & added_bit) == 0;
+}
+
+void piece_state_table::clear_added(int piece_index)
+{
+    set_bit(piece_index, added_bit, false);
+}
+
+bool piece_state_table::set_origin(int piece_index, int source)
+{
+    if(piece_index < 0 || piece_index >= num_pieces_ || source < 0 || source > max_origin) {
+        return false;
+    }
+
+    // the flags may be changed by other threads meanwhile, so only the
+    // origin bits are replaced
+    boost::atomic<unsigned char>& state = states_[piece_index];
+    unsigned char expected = state.load(boost::memory_order_relaxed);
+    unsigned char desired;
+    do {
+        desired = static_cast<unsigned char>((expected & ~origin_mask) | source);
+    } while(!state.compare_exchange_weak(expected, desired, boost::memory_order_release,
+                                                             boost::memory_order_relaxed));
+    return true;
+}
+
+unsigned char piece_state_table::state(int piece_index) const
+{
+    if(piece_index < 0 || piece_index >= num_pieces_) {
+        return 0;
+    }
+    return states_[piece_index].load(boost::memory_order_acquire);
+}
+
+void piece_state_table::set_bit(int piece_index, unsigned char bit, bool value)
+{
+    if(piece_index < 0 || piece_index >= num_pieces_) {
+        return;
+    }
+    if(value) {
+        states_[piece_index].fetch_or(bit, boost::memory_order_release);
+    } else {
+        states_[piece_index].fetch_and(static_cast<unsigned char>(~bit), boost::memory_order_release);
+    }
+}
@@ -0,0 +1,127 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include "cow/libcow_def.hpp"
+#include "cow/seek_prefetcher.hpp"
+
+#include <boost/log/trivial.hpp>
+
+#include <algorithm>
+#include <fstream>
+
+using namespace libcow;
+
+// the weight of the earlier seeks is multiplied by this at each new seek
+static const double seek_decay = 0.95;
+// targets whose weight falls below this are forgotten
+static const double min_seek_weight = 0.05;
+// targets must have at least this weight to be prefetched
+static const double min_target_weight = 1.5;
+// the most targets to remember
+static const size_t max_seek_targets = 64;
+
+seek_prefetcher::seek_prefetcher(size_t piece_size)
+    : piece_size_(piece_size)
+{
+
+}
+
+void seek_prefetcher::record_seek(size_t offset)
+{
+    std::map<size_t, double>::iterator it = weights_.begin();
+    while(it != weights_.end()) {
+        it->second *= seek_decay;
+        if(it->second < min_seek_weight) {
+            weights_.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    weights_[offset / piece_size_] += 1.0;
+
+    // make room by forgetting the least likely target
+    while(weights_.size() > max_seek_targets) {
+        std::map<size_t, double>::iterator least = weights_.begin();
+        for(it = weights_.begin(); it != weights_.end(); ++it) {
+            if(it->second < least->second) {
+                least = it;
+            }
+        }
+        weights_.erase(least);
+    }
+}
+
+void seek_prefetcher::likely_targets(size_t max_targets, std::vector<size_t>& targets) const
+{
+    std::vector<std::pair<double, size_t> > candidates;
+    std::map<size_t, double>::const_iterator it;
+    for(it = weights_.begin(); it != weights_.end(); ++it) {
+        if(it->second >= min_target_weight) {
+            candidates.push_back(std::make_pair(it->second, it->first));
+        }
+    }
+    std::sort(candidates.rbegin(), candidates.rend());
+
+    for(size_t i = 0; i < candidates.size() && i < max_targets; ++i) {
+        targets.push_back(candidates[i].second * piece_size_);
+    }
+}
+
+bool seek_prefetcher::load(const std::string& path)
+{
+    std::ifstream file(path.c_str());
+    if(!file) {
+        return false;
+    }
+
+    weights_.clear();
+    size_t piece_index;
+    double weight;
+    while(file >> piece_index >> weight) {
+        if(weight >= min_seek_weight) {
+            weights_[piece_index] = weight;
+        }
+    }
+    return true;
+}
+
+bool seek_prefetcher::save(const std::string& path) const
+{
+    std::ofstream file(path.c_str());
+    if(!file) {
+        BOOST_LOG_TRIVIAL(warning) << "seek_prefetcher: could not write " << path;
+        return false;
+    }
+
+    std::map<size_t, double>::const_iterator it;
+    for(it = weights_.begin(); it != weights_.end(); ++it) {
+        file << it->first << " " << it->second << "\n";
+    }
+    return file.good();
+}
@@ -0,0 +1,136 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include <cow/libcow_def.hpp>
+#include <cow/device_statistics.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "test_utils.hpp"
+
+using libcow::device_statistics;
+
+bool near(double a, double b)
+{
+    return std::fabs(a - b) <= 1e-9 * std::max(1.0, std::fabs(b));
+}
+
+void test_initial()
+{
+    // a device without samples is assumed to be fast
+    device_statistics stats;
+    CHECK(stats.latency() > 0.0 && stats.latency() < 1.0);
+    CHECK(stats.throughput() > 0.0);
+    CHECK(stats.error_rate() == 0.0);
+    CHECK(stats.queued_bytes() == 0);
+}
+
+void test_averages()
+{
+    device_statistics stats;
+
+    // the first sample replaces the initial guess
+    stats.add_latency(1.0);
+    CHECK(near(stats.latency(), 1.0));
+    stats.add_throughput(1000.0);
+    CHECK(near(stats.throughput(), 1000.0));
+
+    // later samples are weighted by 0.25
+    stats.add_latency(3.0);
+    CHECK(near(stats.latency(), 1.5));
+    stats.add_throughput(5000.0);
+    CHECK(near(stats.throughput(), 2000.0));
+
+    stats.request_failed(0);
+    CHECK(near(stats.error_rate(), 0.25));
+    stats.request_failed(0);
+    CHECK(near(stats.error_rate(), 0.4375));
+    stats.request_succeeded();
+    CHECK(near(stats.error_rate(), 0.328125));
+}
+
+void test_queued_bytes()
+{
+    device_statistics stats;
+    stats.request_sent(1000);
+    stats.request_sent(500);
+    CHECK(stats.queued_bytes() == 1500);
+    stats.bytes_delivered(400);
+    CHECK(stats.queued_bytes() == 1100);
+
+    // failed requests are no longer queued
+    stats.request_failed(100);
+    CHECK(stats.queued_bytes() == 1000);
+
+    // more data than requested doesn't wrap around
+    stats.bytes_delivered(5000);
+    CHECK(stats.queued_bytes() == 0);
+}
+
+void test_expected_completion()
+{
+    device_statistics stats;
+    stats.add_latency(0.5);
+    stats.add_throughput(1000.0);
+    CHECK(near(stats.expected_completion(2000), 2.5));
+
+    // the data queued at the device goes first
+    stats.request_sent(1000);
+    CHECK(near(stats.expected_completion(2000), 3.5));
+    CHECK(stats.expected_completion(2000) > stats.expected_completion(1000));
+
+    // failed requests have to be made again
+    stats.request_failed(1000);
+    CHECK(near(stats.expected_completion(2000), 2.5 / 0.75));
+
+    // a device that keeps failing is slow, but not infinitely so
+    for(int i = 0; i < 100; ++i) {
+        stats.request_failed(0);
+    }
+    CHECK(near(stats.expected_completion(2000), 2.5 / 0.05));
+
+    // and a device that reports no throughput doesn't divide by zero
+    device_statistics stalled;
+    stalled.add_latency(0.0);
+    stalled.add_throughput(0.0);
+    CHECK(near(stalled.expected_completion(10), 10.0));
+}
+
+int main()
+{
+    test_initial();
+    test_averages();
+    test_queued_bytes();
+    test_expected_completion();
+
+    std::cout << "device_statistics tests passed" << std::endl;
+    return 0;
+}
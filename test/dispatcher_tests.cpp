@@ -0,0 +1,223 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include <cow/libcow_def.hpp>
+#include <cow/dispatcher.hpp>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using namespace boost::posix_time;
+
+boost::mutex mutex;
+boost::condition_variable fired_changed;
+std::vector<int> fired;
+std::vector<time_duration> fired_after;
+ptime start_time;
+
+void record(int value)
+{
+    boost::mutex::scoped_lock lock(mutex);
+    fired.push_back(value);
+    fired_after.push_back(microsec_clock::universal_time() - start_time);
+    fired_changed.notify_all();
+}
+
+void reset()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    fired.clear();
+    fired_after.clear();
+    start_time = microsec_clock::universal_time();
+}
+
+size_t num_fired()
+{
+    boost::mutex::scoped_lock lock(mutex);
+    return fired.size();
+}
+
+// waits until count jobs have fired, or the timeout has passed
+bool wait_for_fired(size_t count, time_duration timeout)
+{
+    ptime deadline = microsec_clock::universal_time() + timeout;
+    boost::mutex::scoped_lock lock(mutex);
+    while(fired.size() < count) {
+        if(!fired_changed.timed_wait(lock, deadline)) {
+            return fired.size() >= count;
+        }
+    }
+    return true;
+}
+
+void test_delayed_order(libcow::dispatcher& disp)
+{
+    reset();
+    disp.post_delayed(boost::bind(&record, 300), 300);
+    disp.post_delayed(boost::bind(&record, 50), 50);
+    disp.post_delayed(boost::bind(&record, 150), 150);
+    disp.post_delayed(boost::bind(&record, 0), 0);
+    CHECK(wait_for_fired(4, seconds(5)));
+
+    boost::mutex::scoped_lock lock(mutex);
+    CHECK(fired[0] == 0 && fired[1] == 50 && fired[2] == 150 && fired[3] == 300);
+    for(size_t i = 0; i < fired.size(); ++i) {
+        // never early
+        CHECK(fired_after[i] >= milliseconds(fired[i]));
+    }
+}
+
+void test_earlier_timer(libcow::dispatcher& disp)
+{
+    reset();
+    disp.post_delayed(boost::bind(&record, 1000), 1000);
+    // the wheel is asleep until the first timer is due by now
+    boost::this_thread::sleep(milliseconds(50));
+    disp.post_delayed(boost::bind(&record, 50), 50);
+    CHECK(wait_for_fired(2, seconds(5)));
+
+    boost::mutex::scoped_lock lock(mutex);
+    CHECK(fired[0] == 50 && fired[1] == 1000);
+    CHECK(fired_after[1] >= milliseconds(1000));
+}
+
+void test_default_delay(libcow::dispatcher& disp)
+{
+    reset();
+    disp.post_delayed(boost::bind(&record, 100));
+    boost::this_thread::sleep(milliseconds(50));
+    CHECK(num_fired() == 0);
+    CHECK(wait_for_fired(1, seconds(5)));
+
+    boost::mutex::scoped_lock lock(mutex);
+    CHECK(fired_after[0] >= milliseconds(100));
+}
+
+void test_cancel(libcow::dispatcher& disp)
+{
+    reset();
+    libcow::dispatcher::timer_id id = disp.post_delayed(boost::bind(&record, 1), 100);
+    disp.post_delayed(boost::bind(&record, 2), 100);
+    bool cancelled = disp.cancel(id);
+    CHECK(cancelled);
+    bool cancelled_again = disp.cancel(id);
+    CHECK(!cancelled_again);
+    CHECK(wait_for_fired(1, seconds(5)));
+    // the cancelled timer was due at the same time
+    CHECK(!wait_for_fired(2, milliseconds(100)));
+
+    boost::mutex::scoped_lock lock(mutex);
+    CHECK(fired[0] == 2);
+}
+
+libcow::dispatcher* periodic_disp;
+libcow::dispatcher::timer_id periodic_id;
+
+void periodic_job()
+{
+    record(0);
+    if(num_fired() == 3) {
+        // cancelling from the worker thread stops the job right away
+        bool cancelled = periodic_disp->cancel(periodic_id);
+        CHECK(cancelled);
+    }
+}
+
+void test_periodic(libcow::dispatcher& disp)
+{
+    reset();
+    periodic_disp = &disp;
+    periodic_id = disp.post_periodic(&periodic_job, 50);
+    CHECK(wait_for_fired(3, seconds(5)));
+    CHECK(!wait_for_fired(4, milliseconds(200)));
+
+    boost::mutex::scoped_lock lock(mutex);
+    for(size_t i = 0; i < fired.size(); ++i) {
+        CHECK(fired_after[i] >= milliseconds(50 * (i + 1)));
+    }
+}
+
+void test_many_timers(libcow::dispatcher& disp)
+{
+    reset();
+    const int num_timers = 2000;
+    std::vector<libcow::dispatcher::timer_id> ids;
+    for(int i = 0; i < num_timers; ++i) {
+        ids.push_back(disp.post_delayed(boost::bind(&record, i), std::rand() % 400));
+    }
+    // every other timer is cancelled
+    for(int i = 0; i < num_timers; i += 2) {
+        bool cancelled = disp.cancel(ids[i]);
+        CHECK(cancelled);
+    }
+    CHECK(wait_for_fired(num_timers / 2, seconds(5)));
+    // give a cancelled timer the chance to fire anyway
+    CHECK(!wait_for_fired(num_timers / 2 + 1, milliseconds(100)));
+
+    boost::mutex::scoped_lock lock(mutex);
+    CHECK(fired.size() == static_cast<size_t>(num_timers / 2));
+    for(size_t i = 0; i < fired.size(); ++i) {
+        CHECK(fired[i] % 2 == 1);
+    }
+}
+
+void test_long_delay(libcow::dispatcher& disp)
+{
+    reset();
+    // longer than one revolution of the timer wheel
+    disp.post_delayed(boost::bind(&record, 3000), 3000);
+    boost::this_thread::sleep(milliseconds(2800));
+    CHECK(num_fired() == 0);
+    CHECK(wait_for_fired(1, seconds(5)));
+
+    boost::mutex::scoped_lock lock(mutex);
+    CHECK(fired_after[0] >= milliseconds(3000));
+}
+
+int main()
+{
+    libcow::dispatcher disp(100);
+
+    test_delayed_order(disp);
+    test_earlier_timer(disp);
+    test_default_delay(disp);
+    test_cancel(disp);
+    test_periodic(disp);
+    test_many_timers(disp);
+    test_long_delay(disp);
+
+    std::cout << "dispatcher tests passed" << std::endl;
+    return 0;
+}
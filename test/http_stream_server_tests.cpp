@@ -0,0 +1,292 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include <cow/cow.hpp>
+#include <cow/http_stream_server.hpp>
+
+#include <boost/asio.hpp>
+#include <boost/atomic.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/thread.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "test_utils.hpp"
+
+using boost::asio::ip::tcp;
+
+/* A stream_source backed by a file on disk. When on_disk is false, all the
+ * data has to be read through read(), which is how a download_control
+ * behaves before the pieces have been downloaded.
+ */
+class file_stream_source : public libcow::stream_source
+{
+public:
+    file_stream_source(const std::string& path, const std::string& data, bool on_disk)
+        : path_(path),
+          data_(data),
+          on_disk_(on_disk),
+          missing_from_(data.size()),
+          last_position_(0),
+          num_position_updates_(0),
+          num_empty_reads_(0) {} // empty
+
+    size_t size()
+    {
+        return data_.size();
+    }
+
+    void set_playback_position(size_t offset)
+    {
+        last_position_ = offset;
+        ++num_position_updates_;
+    }
+
+    size_t read(size_t offset, libcow::utils::buffer& buffer, int timeout)
+    {
+        if(offset >= missing_from_) {
+            // not downloaded yet, a shorter wait than a real timeout
+            boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+            ++num_empty_reads_;
+            return 0;
+        }
+        size_t count = std::min(buffer.size(), data_.size() - offset);
+        memcpy(buffer.data(), data_.data() + offset, count);
+        return count;
+    }
+
+    size_t bytes_on_disk(size_t offset)
+    {
+        return on_disk_ && offset < missing_from_ ? missing_from_ - offset : 0;
+    }
+
+    std::string filename()
+    {
+        return path_;
+    }
+
+    size_t last_position()
+    {
+        return last_position_;
+    }
+
+    size_t num_position_updates()
+    {
+        return num_position_updates_;
+    }
+
+    // the data from offset on is reported as not downloaded
+    void set_missing_from(size_t offset)
+    {
+        missing_from_ = offset;
+    }
+
+    size_t num_empty_reads()
+    {
+        return num_empty_reads_;
+    }
+
+private:
+    std::string path_;
+    std::string data_;
+    bool on_disk_;
+    boost::atomic<size_t> missing_from_;
+    boost::atomic<size_t> last_position_;
+    boost::atomic<size_t> num_position_updates_;
+    boost::atomic<size_t> num_empty_reads_;
+};
+
+struct http_response
+{
+    int status;
+    std::map<std::string, std::string> headers;
+    std::string body;
+};
+
+/* Reads one response from the socket. The body is read according to
+ * Content-Length, unless it is a response to a HEAD request.
+ */
+http_response read_response(tcp::socket& socket, boost::asio::streambuf& buf, bool head)
+{
+    http_response response;
+    boost::asio::read_until(socket, buf, "\r\n\r\n");
+
+    std::istream stream(&buf);
+    std::string version;
+    stream >> version >> response.status;
+    std::string line;
+    std::getline(stream, line);
+    while(std::getline(stream, line) && line != "\r") {
+        std::string::size_type colon = line.find(':');
+        response.headers[line.substr(0, colon)] = line.substr(colon + 2, line.size() - colon - 3);
+    }
+
+    size_t length = boost::lexical_cast<size_t>(response.headers["Content-Length"]);
+    if(!head && length > 0) {
+        if(buf.size() < length) {
+            boost::asio::read(socket, buf, boost::asio::transfer_at_least(length - buf.size()));
+        }
+        std::vector<char> body(length);
+        stream.read(&body[0], length);
+        response.body.assign(body.begin(), body.end());
+    }
+    return response;
+}
+
+http_response request(unsigned short port, const std::string& method, const std::string& headers)
+{
+    boost::asio::io_service io_service;
+    tcp::socket socket(io_service);
+    socket.connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port));
+
+    std::string req = method + " /stream HTTP/1.1\r\nHost: localhost\r\n" + headers + 
+                      "Connection: close\r\n\r\n";
+    boost::asio::write(socket, boost::asio::buffer(req));
+
+    boost::asio::streambuf buf;
+    return read_response(socket, buf, method == "HEAD");
+}
+
+void test_server(bool on_disk)
+{
+    std::string path = "http_stream_server_tests.dat";
+    std::string data;
+    for(size_t i = 0; i < 1000000; ++i) {
+        data += static_cast<char>('a' + (i * 7) % 26);
+    }
+    std::ofstream file(path.c_str(), std::ios_base::out | std::ios_base::binary);
+    file.write(data.data(), data.size());
+    file.close();
+
+    file_stream_source source(path, data, on_disk);
+    libcow::http_stream_server server(source, "video/MP2T");
+    unsigned short port = server.start();
+    CHECK(port != 0);
+
+    // the whole resource, the position isn't updated for every chunk sent
+    http_response response = request(port, "GET", "");
+    CHECK(source.num_position_updates() == 1);
+    CHECK(response.status == 200);
+    CHECK(response.headers["Accept-Ranges"] == "bytes");
+    CHECK(response.headers["Content-Type"] == "video/MP2T");
+    CHECK(response.body == data);
+
+    // a closed range in the middle
+    response = request(port, "GET", "Range: bytes=300000-300099\r\n");
+    CHECK(response.status == 206);
+    CHECK(response.headers["Content-Range"] == "bytes 300000-300099/1000000");
+    CHECK(response.body == data.substr(300000, 100));
+    CHECK(source.last_position() == 300000);
+
+    // an open range
+    response = request(port, "GET", "Range: bytes=999990-\r\n");
+    CHECK(response.status == 206);
+    CHECK(response.body == data.substr(999990));
+
+    // a suffix range
+    response = request(port, "GET", "Range: bytes=-5\r\n");
+    CHECK(response.status == 206);
+    CHECK(response.headers["Content-Range"] == "bytes 999995-999999/1000000");
+    CHECK(response.body == data.substr(999995));
+
+    // a range past the end
+    response = request(port, "GET", "Range: bytes=1000000-\r\n");
+    CHECK(response.status == 416);
+    CHECK(response.headers["Content-Range"] == "bytes */1000000");
+
+    // HEAD doesn't send a body
+    response = request(port, "HEAD", "Range: bytes=0-9\r\n");
+    CHECK(response.status == 206);
+    CHECK(response.headers["Content-Length"] == "10");
+    CHECK(response.body.empty());
+
+    // other methods aren't allowed
+    response = request(port, "POST", "");
+    CHECK(response.status == 405);
+
+    // several requests on one connection
+    {
+        boost::asio::io_service io_service;
+        tcp::socket socket(io_service);
+        socket.connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port));
+        boost::asio::streambuf buf;
+        for(int i = 0; i < 3; ++i) {
+            std::string req = "GET / HTTP/1.1\r\nRange: bytes=" + 
+                              boost::lexical_cast<std::string>(i * 1000) + "-" + 
+                              boost::lexical_cast<std::string>(i * 1000 + 9) + "\r\n\r\n";
+            boost::asio::write(socket, boost::asio::buffer(req));
+            response = read_response(socket, buf, false);
+            CHECK(response.status == 206);
+            CHECK(response.body == data.substr(i * 1000, 10));
+        }
+    }
+
+    // a client that goes away while waiting for data stops the polling
+    source.set_missing_from(500000);
+    {
+        boost::asio::io_service io_service;
+        tcp::socket socket(io_service);
+        socket.connect(tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), port));
+        std::string req = "GET / HTTP/1.1\r\nRange: bytes=500000-\r\n\r\n";
+        boost::asio::write(socket, boost::asio::buffer(req));
+        boost::asio::streambuf buf;
+        boost::asio::read_until(socket, buf, "\r\n\r\n");
+    }
+    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+    size_t empty_reads = source.num_empty_reads();
+    CHECK(empty_reads > 0);
+    boost::this_thread::sleep(boost::posix_time::milliseconds(200));
+    CHECK(source.num_empty_reads() == empty_reads);
+    source.set_missing_from(data.size());
+
+    server.stop();
+    remove(path.c_str());
+}
+
+int main()
+{
+    // INTEGRATION TESTING GUIDELINES:
+    // * add test classes to this project
+    // * run all tests in this main function
+    // * use CHECK for assertions, assert is turned off in release builds
+
+    BOOST_LOG_TRIVIAL(info) << "Testing http_stream_server with data on disk";
+    test_server(true);
+
+    BOOST_LOG_TRIVIAL(info) << "Testing http_stream_server with data read from the source";
+    test_server(false);
+
+    std::cout << "All http_stream_server tests passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include <cow/libcow_def.hpp>
+#include <cow/piece_request.hpp>
+
+#include <iostream>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using libcow::piece_request;
+
+const size_t piece_size = 1024;
+
+bool is_run(const piece_request& req, size_t index, size_t count)
+{
+    return req.piece_size == piece_size && req.index == index && req.count == count;
+}
+
+void test_runs()
+{
+    std::vector<piece_request> reqs;
+    reqs.push_back(piece_request(piece_size, 3, 1));
+    reqs.push_back(piece_request(piece_size, 4, 1));
+    reqs.push_back(piece_request(piece_size, 5, 1));
+    reqs.push_back(piece_request(piece_size, 8, 1));
+
+    std::vector<piece_request> ranged;
+    libcow::coalesce_piece_requests(reqs, ranged);
+    CHECK(ranged.size() == 2);
+    CHECK(is_run(ranged[0], 3, 3));
+    CHECK(is_run(ranged[1], 8, 1));
+}
+
+void test_unsorted_and_duplicates()
+{
+    // the same piece in several requests is only requested once
+    std::vector<piece_request> reqs;
+    reqs.push_back(piece_request(piece_size, 10, 2));
+    reqs.push_back(piece_request(piece_size, 2, 3));
+    reqs.push_back(piece_request(piece_size, 3, 1));
+    reqs.push_back(piece_request(piece_size, 11, 1));
+    reqs.push_back(piece_request(piece_size, 5, 1));
+    reqs.push_back(piece_request(piece_size, 2, 1));
+
+    std::vector<piece_request> ranged;
+    libcow::coalesce_piece_requests(reqs, ranged);
+    CHECK(ranged.size() == 2);
+    CHECK(is_run(ranged[0], 2, 4));
+    CHECK(is_run(ranged[1], 10, 2));
+}
+
+void test_empty()
+{
+    std::vector<piece_request> ranged;
+    libcow::coalesce_piece_requests(std::vector<piece_request>(), ranged);
+    CHECK(ranged.empty());
+
+    // a request for no pieces doesn't become a run
+    std::vector<piece_request> reqs(1, piece_request(piece_size, 7, 0));
+    libcow::coalesce_piece_requests(reqs, ranged);
+    CHECK(ranged.empty());
+}
+
+void test_append()
+{
+    // the runs that were already in the vector aren't extended
+    std::vector<piece_request> ranged(1, piece_request(piece_size, 0, 2));
+    std::vector<piece_request> reqs(1, piece_request(piece_size, 2, 2));
+    libcow::coalesce_piece_requests(reqs, ranged);
+    CHECK(ranged.size() == 2);
+    CHECK(is_run(ranged[0], 0, 2));
+    CHECK(is_run(ranged[1], 2, 2));
+}
+
+int main()
+{
+    test_runs();
+    test_unsorted_and_duplicates();
+    test_empty();
+    test_append();
+
+    std::cout << "piece_request tests passed" << std::endl;
+    return 0;
+}
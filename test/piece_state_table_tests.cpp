@@ -0,0 +1,161 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include <cow/libcow_def.hpp>
+#include <cow/piece_state_table.hpp>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <iostream>
+
+#include "test_utils.hpp"
+
+using libcow::piece_state_table;
+
+void test_fields()
+{
+    piece_state_table table(10);
+    CHECK(table.num_pieces() == 10);
+    CHECK(table.state(0) == 0);
+
+    table.set_origin(3, 5);
+    table.set_requested(3, true);
+    table.set_have(3, true);
+    CHECK(table.origin(3) == 5);
+    CHECK(table.is_requested(3));
+    CHECK(table.has_piece(3));
+
+    // each field only touches its own bits
+    table.set_requested(3, false);
+    CHECK(table.origin(3) == 5 && !table.is_requested(3) && table.has_piece(3));
+    table.set_origin(3, 0);
+    CHECK(table.state(3) == piece_state_table::have_bit);
+    table.set_origin(3, piece_state_table::max_origin);
+    CHECK(table.origin(3) == piece_state_table::max_origin);
+    CHECK(table.has_piece(3) && !table.is_requested(3));
+    CHECK(!table.has_piece(2) && !table.has_piece(4));
+}
+
+void test_out_of_range()
+{
+    piece_state_table table(10);
+    CHECK(!table.set_origin(3, piece_state_table::max_origin + 1));
+    CHECK(!table.set_origin(3, -1));
+    CHECK(!table.set_origin(10, 1));
+    CHECK(!table.set_origin(-1, 1));
+    CHECK(table.state(3) == 0);
+
+    table.set_have(10, true);
+    table.set_requested(-1, true);
+    CHECK(!table.mark_added(10));
+    CHECK(table.state(10) == 0 && table.state(-1) == 0);
+}
+
+void test_added()
+{
+    piece_state_table table(10);
+    table.set_origin(4, 2);
+
+    // only the first device gets to add a piece
+    CHECK(table.mark_added(4));
+    CHECK(!table.mark_added(4));
+    CHECK(table.origin(4) == 2);
+    CHECK((table.state(4) & piece_state_table::added_bit) != 0);
+
+    // until the hash check fails
+    table.clear_added(4);
+    CHECK(table.mark_added(4));
+    CHECK(table.origin(4) == 2);
+}
+
+void test_have()
+{
+    piece_state_table table(10);
+    table.set_origin(1, 3);
+    table.set_requested(2, true);
+
+    libtorrent::bitfield pieces(10, false);
+    pieces.set_bit(1);
+    pieces.set_bit(9);
+    table.reset_have(pieces);
+    CHECK(table.has_piece(1) && table.has_piece(9));
+    CHECK(!table.has_piece(0) && !table.has_piece(2));
+    CHECK(table.origin(1) == 3 && table.is_requested(2));
+
+    table.set_all_have();
+    for(int i = 0; i < table.num_pieces(); ++i) {
+        CHECK(table.has_piece(i));
+    }
+    CHECK(table.origin(1) == 3 && table.is_requested(2));
+}
+
+void toggle_requested(piece_state_table& table, int times)
+{
+    for(int i = 0; i < times; ++i) {
+        table.set_requested(0, i % 2 == 0);
+    }
+    table.set_requested(0, true);
+}
+
+void change_origin(piece_state_table& table, int times)
+{
+    for(int i = 0; i < times; ++i) {
+        table.set_origin(0, 1 + i % piece_state_table::max_origin);
+    }
+    table.set_origin(0, 7);
+}
+
+void test_concurrent_writes()
+{
+    // the origin is replaced with a CAS loop, which must not lose the
+    // flags that are set from other threads meanwhile
+    piece_state_table table(1);
+    boost::thread requester(boost::bind(&toggle_requested, boost::ref(table), 100000));
+    boost::thread origin_writer(boost::bind(&change_origin, boost::ref(table), 100000));
+    table.set_have(0, true);
+    requester.join();
+    origin_writer.join();
+
+    CHECK(table.has_piece(0));
+    CHECK(table.is_requested(0));
+    CHECK(table.origin(0) == 7);
+}
+
+int main()
+{
+    test_fields();
+    test_out_of_range();
+    test_added();
+    test_have();
+    test_concurrent_writes();
+
+    std::cout << "piece_state_table tests passed" << std::endl;
+    return 0;
+}
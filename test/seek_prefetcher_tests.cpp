@@ -0,0 +1,186 @@
+/*
+Copyright 2010 CowboyCoders. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without modification,
+are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+
+   2. Redistributions in binary form must reproduce the above copyright notice,
+      this list of conditions and the following disclaimer in the documentation
+      and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY COWBOYCODERS ``AS IS'' AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT
+SHALL COWBOYCODERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of CowboyCoders.
+*/
+
+#include <cow/libcow_def.hpp>
+#include <cow/seek_prefetcher.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "test_utils.hpp"
+
+using libcow::seek_prefetcher;
+
+const size_t piece_size = 1000;
+const std::string history_path = "seek_prefetcher_tests.seeks";
+
+std::vector<size_t> targets(const seek_prefetcher& prefetcher, size_t max_targets = 10)
+{
+    std::vector<size_t> result;
+    prefetcher.likely_targets(max_targets, result);
+    return result;
+}
+
+size_t num_saved_targets(const seek_prefetcher& prefetcher)
+{
+    CHECK(prefetcher.save(history_path));
+    std::ifstream file(history_path.c_str());
+    size_t count = 0;
+    std::string line;
+    while(std::getline(file, line)) {
+        ++count;
+    }
+    return count;
+}
+
+void test_targets()
+{
+    seek_prefetcher prefetcher(piece_size);
+    CHECK(prefetcher.empty());
+
+    // a single seek isn't a pattern
+    prefetcher.record_seek(5500);
+    CHECK(!prefetcher.empty());
+    CHECK(targets(prefetcher).empty());
+
+    // seeks are counted by piece, and the target is the start of the piece
+    prefetcher.record_seek(5900);
+    std::vector<size_t> result = targets(prefetcher);
+    CHECK(result.size() == 1 && result[0] == 5000);
+
+    // the most likely target comes first, and max_targets is respected
+    for(int i = 0; i < 3; ++i) {
+        prefetcher.record_seek(20000);
+    }
+    prefetcher.record_seek(30000);
+    prefetcher.record_seek(30000);
+    result = targets(prefetcher);
+    CHECK(result.size() == 3);
+    CHECK(result[0] == 20000);
+    result = targets(prefetcher, 1);
+    CHECK(result.size() == 1 && result[0] == 20000);
+}
+
+void test_decay()
+{
+    seek_prefetcher prefetcher(piece_size);
+    prefetcher.record_seek(0);
+    prefetcher.record_seek(0);
+
+    // 1.95 decays below the target weight of 1.5 after six other seeks
+    for(size_t i = 1; i <= 5; ++i) {
+        prefetcher.record_seek(i * piece_size);
+    }
+    CHECK(targets(prefetcher).size() == 1);
+    prefetcher.record_seek(6 * piece_size);
+    CHECK(targets(prefetcher).empty());
+
+    // and a single seek is forgotten once it weighs less than 0.05
+    seek_prefetcher forgetful(piece_size);
+    forgetful.record_seek(0);
+    for(size_t i = 1; i <= 58; ++i) {
+        forgetful.record_seek(i * piece_size);
+    }
+    CHECK(num_saved_targets(forgetful) == 59);
+    forgetful.record_seek(59 * piece_size);
+    CHECK(num_saved_targets(forgetful) == 59);
+}
+
+void test_eviction()
+{
+    // a history with the most targets there is room for
+    {
+        std::ofstream file(history_path.c_str());
+        file << "0 5\n";
+        for(size_t i = 100; i < 163; ++i) {
+            file << i << " 1\n";
+        }
+    }
+    seek_prefetcher prefetcher(piece_size);
+    CHECK(prefetcher.load(history_path));
+    CHECK(num_saved_targets(prefetcher) == 64);
+
+    // a new target takes the place of the least likely one
+    prefetcher.record_seek(500 * piece_size);
+    CHECK(num_saved_targets(prefetcher) == 64);
+
+    seek_prefetcher reloaded(piece_size);
+    CHECK(reloaded.load(history_path));
+    reloaded.record_seek(500 * piece_size);
+    std::vector<size_t> result = targets(reloaded);
+    CHECK(result.size() == 2);
+    CHECK(result[0] == 0 && result[1] == 500 * piece_size);
+}
+
+void test_save_load()
+{
+    seek_prefetcher prefetcher(piece_size);
+    for(int i = 0; i < 4; ++i) {
+        prefetcher.record_seek(7000);
+        prefetcher.record_seek(12345);
+        prefetcher.record_seek(3000);
+    }
+    prefetcher.record_seek(3000);
+    CHECK(prefetcher.save(history_path));
+
+    seek_prefetcher loaded(piece_size);
+    CHECK(loaded.load(history_path));
+    CHECK(targets(loaded) == targets(prefetcher));
+    CHECK(targets(loaded)[0] == 3000);
+
+    // a missing file leaves the history alone
+    remove(history_path.c_str());
+    CHECK(!loaded.load(history_path));
+    CHECK(targets(loaded) == targets(prefetcher));
+
+    // weights that would have been forgotten aren't loaded
+    {
+        std::ofstream file(history_path.c_str());
+        file << "1 0.01\n";
+    }
+    CHECK(loaded.load(history_path));
+    CHECK(loaded.empty());
+
+    remove(history_path.c_str());
+}
+
+int main()
+{
+    test_targets();
+    test_decay();
+    test_eviction();
+    test_save_load();
+
+    remove(history_path.c_str());
+    std::cout << "seek_prefetcher tests passed" << std::endl;
+    return 0;
+}